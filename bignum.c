@@ -1,15 +1,184 @@
 #include "bignum.h"
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/jump_label.h>
+#include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/linkage.h>
 #include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#endif
 
 
-void bn_init(bn *p)
+/* Per CPU, so counting never bounces a cache line between workers */
+struct bn_alloc_stat {
+    long count;
+    long bytes;
+};
+static DEFINE_PER_CPU(struct bn_alloc_stat, bn_allocs);
+
+static void bn_count_alloc(size_t size)
+{
+    this_cpu_inc(bn_allocs.count);
+    this_cpu_add(bn_allocs.bytes, size);
+}
+
+long bn_alloc_count(void)
+{
+    long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        sum += per_cpu(bn_allocs.count, cpu);
+    return sum;
+}
+
+long bn_alloc_bytes(void)
+{
+    long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        sum += per_cpu(bn_allocs.bytes, cpu);
+    return sum;
+}
+
+/* Limbs of large numbers can exceed what kmalloc finds contiguous */
+static void *bn_malloc(size_t size)
+{
+    bn_count_alloc(size);
+    return kvmalloc(size, GFP_KERNEL);
+}
+
+static void *bn_realloc(void *p, size_t old, size_t size)
+{
+    void *q = bn_malloc(size);
+    if (q && p)
+        memcpy(q, p, min(old, size));
+    if (q)
+        kvfree(p);
+    return q;
+}
+
+/* Arena blocks keep the alignment of the widest bignum type */
+#define BN_ARENA_ALIGN sizeof(u_bn_data_tmp)
+
+/* An arena never keeps a block larger than this across requests */
+#define BN_ARENA_KEEP_MAX (16UL << 20)
+
+/* Header of an allocation that did not fit in the arena block */
+union bn_arena_spill {
+    union bn_arena_spill *next;
+    u_bn_data_tmp align;
+};
+
+void bn_arena_init(struct bn_arena *ar)
+{
+    memset(ar, 0, sizeof(*ar));
+}
+
+void *bn_arena_alloc(struct bn_arena *ar, size_t size)
+{
+    size = ALIGN(size, BN_ARENA_ALIGN);
+    ar->demand += size;
+    if (size <= ar->size - ar->used) {
+        void *p = ar->base + ar->used;
+        ar->used += size;
+        return p;
+    }
+
+    bn_count_alloc(sizeof(union bn_arena_spill) + size);
+    union bn_arena_spill *s = kvmalloc(sizeof(*s) + size, GFP_KERNEL);
+    if (!s)
+        return NULL;
+    s->next = ar->spill;
+    ar->spill = s;
+    return s + 1;
+}
+
+/* The most recent block can grow in place, anything else is copied */
+static void *bn_arena_realloc(struct bn_arena *ar,
+                              void *p,
+                              size_t old,
+                              size_t size)
+{
+    old = ALIGN(old, BN_ARENA_ALIGN);
+    size = ALIGN(size, BN_ARENA_ALIGN);
+    if (p && (char *) p + old == ar->base + ar->used &&
+        size - old <= ar->size - ar->used) {
+        ar->used += size - old;
+        ar->demand += size - old;
+        return p;
+    }
+
+    void *q = bn_arena_alloc(ar, size);
+    if (q && p)
+        memcpy(q, p, old);
+    return q;
+}
+
+/*
+ * Release everything handed out since the last reset. If the request did
+ * not fit, the block is resized so that the next one of the same size does.
+ */
+void bn_arena_reset(struct bn_arena *ar)
+{
+    while (ar->spill) {
+        union bn_arena_spill *s = ar->spill;
+        ar->spill = s->next;
+        kvfree(s);
+    }
+
+    if (ar->demand > ar->size && ar->demand <= BN_ARENA_KEEP_MAX) {
+        kvfree(ar->base);
+        bn_count_alloc(ar->demand);
+        ar->base = kvmalloc(ar->demand, GFP_KERNEL);
+        ar->size = ar->base ? ar->demand : 0;
+    }
+    ar->used = 0;
+    ar->demand = 0;
+}
+
+void bn_arena_destroy(struct bn_arena *ar)
+{
+    bn_arena_reset(ar);
+    kvfree(ar->base);
+    bn_arena_init(ar);
+}
+
+/* Memory of a bignum, and of its temporaries, comes from its arena if any */
+static void *bn_mem_alloc(struct bn_arena *ar, size_t size)
+{
+    return ar ? bn_arena_alloc(ar, size) : bn_malloc(size);
+}
+
+static void bn_mem_free(struct bn_arena *ar, const void *p)
+{
+    /* arena memory goes away on bn_arena_reset() */
+    if (!ar)
+        kvfree(p);
+}
+
+/* Small numbers live in the inline limbs and need no allocation */
+void bn_init_arena(bn *p, struct bn_arena *arena)
 {
     if (!p)
         return;
     p->sign = 0;
     p->size = 1;
-    p->num = kzalloc(sizeof(bn_data) * p->size, GFP_KERNEL);
+    p->capacity = BN_INLINE;
+    p->arena = arena;
+    p->num = p->inl;
+    p->num[0] = 0;
+}
+
+void bn_init(bn *p)
+{
+    bn_init_arena(p, NULL);
 }
 
 
@@ -17,33 +186,79 @@ void bn_free(bn *p)
 {
     if (!p)
         return;
-    kfree(p->num);
+    if (p->num != p->inl)
+        bn_mem_free(p->arena, p->num);
     p->num = NULL;
+    p->capacity = 0;
 }
 
-/* data loss is ignored when shrinking size */
-static void bn_resize(bn *p, unsigned int size)
+void bn_free_string(const bn *p, char *s)
+{
+    bn_mem_free(p->arena, s);
+}
+
+int bn_reserve(bn *p, unsigned int capacity)
+{
+    if (capacity <= p->capacity)
+        return 0;
+
+    size_t size = sizeof(bn_data) * capacity;
+    bn_data *num;
+    if (p->num == p->inl) {
+        num = bn_mem_alloc(p->arena, size);
+        if (num)
+            memcpy(num, p->inl, sizeof(p->inl));
+    } else if (p->arena) {
+        num = bn_arena_realloc(p->arena, p->num,
+                               sizeof(bn_data) * p->capacity, size);
+    } else {
+        num = bn_realloc(p->num, sizeof(bn_data) * p->capacity, size);
+    }
+    if (!num)
+        return -ENOMEM;
+    p->num = num;
+    p->capacity = capacity;
+    return 0;
+}
+
+/* Swap A and B, keeping inline limbs pointed to by their owner */
+static void bn_swap(bn *a, bn *b)
+{
+    swap(*a, *b);
+    if (a->num == b->inl)
+        a->num = a->inl;
+    if (b->num == a->inl)
+        b->num = b->inl;
+}
+
+/*
+ * Data loss is ignored when shrinking size, which never fails. On -ENOMEM P
+ * is left as it was.
+ */
+static int bn_resize(bn *p, unsigned int size)
 {
-    if (!p)
-        return;
     if (p->size == size)
-        return;
+        return 0;
 
-    p->num = krealloc(p->num, sizeof(bn_data) * size, GFP_KERNEL);
-    if (!p->num)
-        return;
+    /* grow geometrically, never give memory back */
+    if (size > p->capacity && bn_reserve(p, max(size, 2 * p->capacity)) &&
+        bn_reserve(p, size))
+        return -ENOMEM;
 
     if (size > p->size)
         memset(p->num + p->size, 0, sizeof(bn_data) * (size - p->size));
 
     p->size = size;
+    return 0;
 }
 
-static void bn_cpy(bn *dest, const bn *src)
+static int bn_cpy(bn *dest, const bn *src)
 {
-    bn_resize(dest, src->size);
+    if (bn_resize(dest, src->size))
+        return -ENOMEM;
     dest->sign = src->sign;
     memcpy(dest->num, src->num, sizeof(bn_data) * src->size);
+    return 0;
 }
 
 static unsigned int bn_clz(const bn *p)
@@ -82,55 +297,181 @@ static int bn_cmp(const bn *a, const bn *b)
 }
 
 
-/* |C| = |A| + |B| */
-static void _bn_add(bn *c, const bn *a, const bn *b)
+#ifdef CONFIG_X86_64
+/* bignum_x86.S, for CPUs with BMI2 and ADX */
+asmlinkage bn_data bn_x86_add_n(bn_data *r,
+                                const bn_data *a,
+                                const bn_data *b,
+                                unsigned int n);
+asmlinkage bn_data bn_x86_sub_n(bn_data *r,
+                                const bn_data *a,
+                                const bn_data *b,
+                                unsigned int n);
+asmlinkage bn_data bn_x86_mul_1(bn_data *r,
+                                const bn_data *a,
+                                unsigned int n,
+                                bn_data b);
+asmlinkage bn_data bn_x86_addmul_1(bn_data *r,
+                                   const bn_data *a,
+                                   unsigned int n,
+                                   bn_data b);
+asmlinkage void bn_x86_mul_basecase(bn_data *r,
+                                    const bn_data *a,
+                                    unsigned int an,
+                                    const bn_data *b,
+                                    unsigned int bn);
+
+static DEFINE_STATIC_KEY_FALSE(bn_x86);
+#endif
+
+int bn_set_asm(bool on)
 {
-    unsigned int digit = max(bn_digit(a), bn_digit(b)) + 1;
-    digit = DIV_ROUND_UP(digit, BN_BIT) + !digit;
-    bn_resize(c, digit);
+#ifdef CONFIG_X86_64
+    if (!on) {
+        static_branch_disable(&bn_x86);
+        return 0;
+    }
+    if (!boot_cpu_has(X86_FEATURE_BMI2) || !boot_cpu_has(X86_FEATURE_ADX))
+        return -EOPNOTSUPP;
+    static_branch_enable(&bn_x86);
+    return 0;
+#else
+    return on ? -EOPNOTSUPP : 0;
+#endif
+}
+
+bool bn_asm_enabled(void)
+{
+#ifdef CONFIG_X86_64
+    return static_branch_likely(&bn_x86);
+#else
+    return false;
+#endif
+}
 
+/* R = A + B, return carry */
+static bn_data bn_add_n(bn_data *r,
+                        const bn_data *a,
+                        const bn_data *b,
+                        unsigned int n)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_x86))
+        return bn_x86_add_n(r, a, b, n);
+#endif
     u_bn_data_tmp carry = 0;
-    for (int i = 0; i < c->size; i++) {
-        bn_data tmp1 = (i < a->size) ? a->num[i] : 0;
-        bn_data tmp2 = (i < b->size) ? b->num[i] : 0;
-        carry += (u_bn_data_tmp) tmp1 + tmp2;
-        c->num[i] = carry;
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (u_bn_data_tmp) a[i] + b[i];
+        r[i] = carry;
         carry >>= BN_BIT;
     }
+    return carry;
 }
 
+/* R = A + c, return carry */
+static bn_data bn_add_1(bn_data *r,
+                        const bn_data *a,
+                        unsigned int n,
+                        bn_data c)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        bn_data t = a[i] + c;
+        c = t < c;
+        r[i] = t;
+    }
+    return c;
+}
 
-/* |C| = |A| - |B|, Assume |A| > |B| */
-static void _bn_sub(bn *c, const bn *a, const bn *b)
+/* R = A + B, assume an >= bn, return carry */
+static bn_data bn_add_nm(bn_data *r,
+                         const bn_data *a,
+                         unsigned int an,
+                         const bn_data *b,
+                         unsigned int bn)
 {
-    unsigned int csize = max(a->size, b->size);
-    bn_resize(c, csize);
+    bn_data carry = bn_add_n(r, a, b, bn);
+    return bn_add_1(r + bn, a + bn, an - bn, carry);
+}
 
-    bn_data_tmp carry = 0;
-    for (int i = 0; i < c->size; i++) {
-        bn_data tmp1 = (i < a->size) ? a->num[i] : 0;
-        bn_data tmp2 = (i < b->size) ? b->num[i] : 0;
-        carry = (bn_data_tmp) tmp1 - tmp2 - carry;
-        c->num[i] =
-            carry + (-(bn_data_tmp) (carry < 0) & ((bn_data_tmp) 1 << BN_BIT));
-        carry = (carry < 0);
+/* R = A - B, return borrow */
+static bn_data bn_sub_n(bn_data *r,
+                        const bn_data *a,
+                        const bn_data *b,
+                        unsigned int n)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_x86))
+        return bn_x86_sub_n(r, a, b, n);
+#endif
+    bn_data borrow = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        bn_data x = a[i], y = b[i];
+        bn_data t = x - y;
+        bn_data c = x < y;
+        c |= t < borrow;
+        r[i] = t - borrow;
+        borrow = c;
     }
+    return borrow;
+}
+
+/* R = A - B, assume an >= bn, return borrow */
+static bn_data bn_sub_nm(bn_data *r,
+                         const bn_data *a,
+                         unsigned int an,
+                         const bn_data *b,
+                         unsigned int bn)
+{
+    bn_data borrow = bn_sub_n(r, a, b, bn);
+    for (unsigned int i = bn; i < an; i++) {
+        bn_data t = a[i];
+        r[i] = t - borrow;
+        borrow = t < borrow;
+    }
+    return borrow;
+}
+
+/* |C| = |A| + |B| */
+static int _bn_add(bn *c, const bn *a, const bn *b)
+{
+    if (a->size < b->size)
+        swap(a, b);
+
+    /* C may alias A or B, whose sizes change with it */
+    unsigned int an = a->size, bn = b->size;
+    if (bn_resize(c, an + 1))
+        return -ENOMEM;
+    c->num[an] = bn_add_nm(c->num, a->num, an, b->num, bn);
+    if (!c->num[an])
+        bn_resize(c, an);
+    return 0;
+}
+
+
+/* |C| = |A| - |B|, Assume |A| > |B| */
+static int _bn_sub(bn *c, const bn *a, const bn *b)
+{
+    unsigned int an = a->size, bn = b->size;
+    if (bn_resize(c, an))
+        return -ENOMEM;
+    bn_sub_nm(c->num, a->num, an, b->num, bn);
 
     /* Remove leading zeros */
-    csize = bn_clz(c) / BN_BIT;
-    if (csize == c->size)  // c is 0
-        --csize;
-    bn_resize(c, c->size - csize);
+    while (an > 1 && !c->num[an - 1])
+        an--;
+    bn_resize(c, an);
+    return 0;
 }
 
 /* C = A + B */
-void bn_add(bn *c, const bn *a, const bn *b)
+int bn_add(bn *c, const bn *a, const bn *b)
 {
     /* both positive or negative */
     if (a->sign == b->sign) {
-        _bn_add(c, a, b);
+        if (_bn_add(c, a, b))
+            return -ENOMEM;
         c->sign = a->sign;
-        return;
+        return 0;
     }
     /* Make sure a > 0 and b < 0 */
     if (a->sign)
@@ -142,12 +483,14 @@ void bn_add(bn *c, const bn *a, const bn *b)
     switch (cmp) {
     case 1:
         // |a| > |b| and b < 0, c = a - |b|
-        _bn_sub(c, a, b);
+        if (_bn_sub(c, a, b))
+            return -ENOMEM;
         c->sign = 0;
         break;
     case -1:
         // |a| < |b| and b < 0, c = -(|b| - a)
-        _bn_sub(c, b, a);
+        if (_bn_sub(c, b, a))
+            return -ENOMEM;
         c->sign = 1;
         break;
     case 0:
@@ -156,172 +499,1683 @@ void bn_add(bn *c, const bn *a, const bn *b)
         c->num[0] = 0;
         c->sign = 0;
         break;
-    default:
-        return;
     }
+    return 0;
 }
 
 
 /* C = A - B */
-void bn_sub(bn *c, const bn *a, const bn *b)
+int bn_sub(bn *c, const bn *a, const bn *b)
 {
     bn tmp = *b;
     tmp.sign ^= 1;
-    bn_add(c, a, &tmp);
+    return bn_add(c, a, &tmp);
 }
 
 
-/* C = A * B */
-void bn_mult(bn *c, const bn *a, const bn *b)
+/* Multiplication crossovers, in limbs of the shorter operand */
+unsigned int bn_karatsuba_threshold = 32;
+unsigned int bn_toom3_threshold = 160;
+unsigned int bn_ntt_threshold = 12288;
+
+/* Sizes from which work is handed to bn_par_run */
+unsigned int bn_par_threshold = 1024;
+unsigned int bn_par_split_threshold = 4096;
+void (*bn_par_run)(bn_job_fn fn, void **arg, unsigned int n);
+
+/* Karatsuba needs a few limbs per half to make progress */
+#define BN_KARATSUBA_MIN 8U
+
+struct bn_mul_param {
+    unsigned int karatsuba;
+    unsigned int toom3;
+    unsigned int ntt;   /* UINT_MAX when disabled */
+    unsigned int split; /* UINT_MAX when products stay on this thread */
+};
+
+static void bn_mul_param_get(struct bn_mul_param *mp)
 {
-    unsigned int csize = a->size + b->size;
+    mp->karatsuba = max(READ_ONCE(bn_karatsuba_threshold), BN_KARATSUBA_MIN);
+    mp->toom3 = max(READ_ONCE(bn_toom3_threshold), mp->karatsuba);
+    mp->ntt = UINT_MAX;
+#if BN_BIT == 64
+    if (READ_ONCE(bn_ntt_threshold))
+        mp->ntt = max(READ_ONCE(bn_ntt_threshold), mp->toom3);
+#endif
+    mp->split = UINT_MAX;
+    if (READ_ONCE(bn_par_run) && READ_ONCE(bn_par_split_threshold))
+        mp->split = max(READ_ONCE(bn_par_split_threshold), mp->karatsuba);
+}
 
-    bn *tmp = NULL;
-    bn_t out;
-    if (c == a || c == b) {
-        tmp = c;
-        c = out;
-        bn_init(c);
+/* Compare A and B of the same length */
+static int bn_cmp_n(const bn_data *a, const bn_data *b, unsigned int n)
+{
+    while (n--) {
+        if (a[n] != b[n])
+            return a[n] > b[n] ? 1 : -1;
+    }
+    return 0;
+}
+
+/* R = A << shift, 0 < shift < BN_BIT, return the bits shifted out */
+static bn_data bn_lshift_n(bn_data *r,
+                           const bn_data *a,
+                           unsigned int n,
+                           unsigned int shift)
+{
+    bn_data out = a[n - 1] >> (BN_BIT - shift);
+    for (unsigned int i = n - 1; i > 0; i--)
+        r[i] = a[i] << shift | a[i - 1] >> (BN_BIT - shift);
+    r[0] = a[0] << shift;
+    return out;
+}
+
+/* A = A / 2 in two's complement, the low bit is known to be zero */
+static void bn_rshift1_signed(bn_data *a, unsigned int n)
+{
+    for (unsigned int i = 0; i < n - 1; i++)
+        a[i] = a[i] >> 1 | a[i + 1] << (BN_BIT - 1);
+    a[n - 1] = a[n - 1] >> 1 | (a[n - 1] & (bn_data) 1 << (BN_BIT - 1));
+}
+
+/* R = -A in two's complement */
+static void bn_neg_n(bn_data *r, const bn_data *a, unsigned int n)
+{
+    bn_data carry = 1;
+    for (unsigned int i = 0; i < n; i++) {
+        bn_data t = ~a[i] + carry;
+        carry = carry && !t;
+        r[i] = t;
+    }
+}
+
+/* R = A / 3, the division is known to be exact (Hensel division) */
+static void bn_divexact_3(bn_data *r, const bn_data *a, unsigned int n)
+{
+    /* 3 * inv == 1 mod 2^BN_BIT */
+    const bn_data inv = (bn_data) 0xAAAAAAAAAAAAAAABULL;
+    bn_data borrow = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        bn_data s = a[i];
+        bn_data c = s < borrow;
+        bn_data q = (s - borrow) * inv;
+        r[i] = q;
+        borrow = (bn_data) (((u_bn_data_tmp) q * 3) >> BN_BIT) + c;
+    }
+}
+
+/* R = A * b, return carry */
+static bn_data bn_mul_1(bn_data *r,
+                        const bn_data *a,
+                        unsigned int n,
+                        bn_data b)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_x86))
+        return bn_x86_mul_1(r, a, n, b);
+#endif
+    u_bn_data_tmp carry = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (u_bn_data_tmp) a[i] * b;
+        r[i] = carry;
+        carry >>= BN_BIT;
+    }
+    return carry;
+}
+
+/* R += A * b, return carry */
+static bn_data bn_addmul_1(bn_data *r,
+                           const bn_data *a,
+                           unsigned int n,
+                           bn_data b)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_x86))
+        return bn_x86_addmul_1(r, a, n, b);
+#endif
+    u_bn_data_tmp carry = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        carry += (u_bn_data_tmp) a[i] * b + r[i];
+        r[i] = carry;
+        carry >>= BN_BIT;
+    }
+    return carry;
+}
+
+/* R = A * B, schoolbook, R has an + bn limbs */
+static void bn_mul_basecase(bn_data *r,
+                            const bn_data *a,
+                            unsigned int an,
+                            const bn_data *b,
+                            unsigned int bn)
+{
+#ifdef CONFIG_X86_64
+    if (static_branch_likely(&bn_x86)) {
+        bn_x86_mul_basecase(r, a, an, b, bn);
+        return;
+    }
+#endif
+    r[an] = bn_mul_1(r, a, an, b[0]);
+    for (unsigned int j = 1; j < bn; j++)
+        r[an + j] = bn_addmul_1(r + j, a, an, b[j]);
+}
+
+static void bn_mul_limbs(bn_data *r,
+                         const bn_data *a,
+                         unsigned int an,
+                         const bn_data *b,
+                         unsigned int bn,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp);
+
+/* Points of a transform for a product of n limbs */
+static size_t bn_ntt_len(size_t n)
+{
+    size_t len = 1;
+    while (len < n)
+        len <<= 1;
+    return len;
+}
+
+/*
+ * Scratch limbs of bn_mul_ntt() when the longer operand has n limbs: the
+ * residues for each prime, then a second operand and twiddles for each
+ * thread
+ */
+static size_t bn_ntt_itch(unsigned int n, const struct bn_mul_param *mp)
+{
+    size_t len = bn_ntt_len(2 * (size_t) n);
+    return 3 * len + (n >= mp->split ? 3 : 1) * (len + len / 2);
+}
+
+/*
+ * Scratch limbs needed by bn_mul_limbs() when the longer operand has n limbs.
+ * Every recursive step below takes at most 6n + 32 limbs for itself and
+ * recurses on operands of at most n / 2 + 2 limbs. The NTT does not
+ * recurse, but the longer operand alone does not tell if it is used.
+ */
+static size_t bn_mul_itch(unsigned int n, const struct bn_mul_param *mp)
+{
+    size_t itch = 0;
+    size_t ntt = n >= mp->ntt ? bn_ntt_itch(n, mp) : 0;
+
+    /* a split step gives each of its products a scratch area of its own */
+    if (n >= mp->split) {
+        struct bn_mul_param seq = *mp;
+        seq.split = UINT_MAX;
+        itch = 6 * (size_t) n + 32 + BN_PAR_MAX * bn_mul_itch(n / 2 + 2, &seq);
+        return max(itch, ntt);
+    }
+
+    for (; n >= mp->karatsuba; n = n / 2 + 2)
+        itch += 6 * (size_t) n + 32;
+    return max(itch, ntt);
+}
+
+static void bn_sqr_limbs(bn_data *r,
+                         const bn_data *a,
+                         unsigned int n,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp);
+
+/* One product of a Karatsuba or Toom-3 step, B == NULL squares A */
+struct bn_mul_job {
+    bn_data *r;
+    const bn_data *a, *b;
+    unsigned int an, bn;
+    bn_data *ws;
+    struct bn_mul_param mp;
+};
+
+static void bn_mul_job_run(void *arg)
+{
+    struct bn_mul_job *j = arg;
+
+    if (j->b)
+        bn_mul_limbs(j->r, j->a, j->an, j->b, j->bn, j->ws, &j->mp);
+    else
+        bn_sqr_limbs(j->r, j->a, j->an, j->ws, &j->mp);
+}
+
+/*
+ * Run the n products of a step on operands of size limbs. From the split
+ * threshold on they go to bn_par_run with a slice of next each, only at
+ * this level; below it they run in order and share next.
+ */
+static void bn_mul_jobs(struct bn_mul_job *job,
+                        unsigned int n,
+                        unsigned int size,
+                        bn_data *next,
+                        const struct bn_mul_param *mp)
+{
+    struct bn_mul_param seq = *mp;
+    void *arg[BN_PAR_MAX];
+    size_t itch = 0;
+
+    seq.split = UINT_MAX;
+    if (size >= mp->split)
+        itch = bn_mul_itch(size / 2 + 2, &seq);
+    for (unsigned int i = 0; i < n; i++) {
+        job[i].ws = next + i * itch;
+        job[i].mp = seq;
+        arg[i] = &job[i];
+    }
+
+    if (itch) {
+        bn_par_run(bn_mul_job_run, arg, n);
+        return;
+    }
+    for (unsigned int i = 0; i < n; i++)
+        bn_mul_job_run(&job[i]);
+}
+
+/* R = A * B, assume an >= 2 * bn, multiply A in bn-limb slices */
+static void bn_mul_unbalanced(bn_data *r,
+                              const bn_data *a,
+                              unsigned int an,
+                              const bn_data *b,
+                              unsigned int bn,
+                              bn_data *ws,
+                              const struct bn_mul_param *mp)
+{
+    bn_data *t = ws;
+
+    bn_mul_limbs(r, a, bn, b, bn, ws, mp);
+    memset(r + 2 * bn, 0, sizeof(bn_data) * (an - bn));
+    for (unsigned int i = bn; i < an; i += bn) {
+        unsigned int len = min(bn, an - i);
+        bn_mul_limbs(t, a + i, len, b, bn, t + 2 * bn, mp);
+        bn_add_nm(r + i, r + i, an + bn - i, t, len + bn);
+    }
+}
+
+/*
+ * R holds A0B0 in its low 2h limbs and A1B1 above them, T holds
+ * (A0 + A1)(B0 + B1). Subtract both from T and add it to R at limb h.
+ */
+static void bn_karatsuba_fold(bn_data *r,
+                              unsigned int rn,
+                              unsigned int h,
+                              bn_data *t,
+                              unsigned int tn)
+{
+    bn_sub_nm(t, t, tn, r, 2 * h);
+    bn_sub_nm(t, t, tn, r + 2 * h, rn - 2 * h);
+    bn_add_nm(r + h, r + h, rn - h, t, min(tn, rn - h));
+}
+
+/*
+ * R = A * B, assume an >= bn > an / 2
+ * A = A1 * x + A0, B = B1 * x + B0, x = 2^(BN_BIT * h)
+ * A * B = A1B1 * x^2 + [(A0 + A1)(B0 + B1) - A0B0 - A1B1] * x + A0B0
+ */
+static void bn_mul_karatsuba(bn_data *r,
+                             const bn_data *a,
+                             unsigned int an,
+                             const bn_data *b,
+                             unsigned int bn,
+                             bn_data *ws,
+                             const struct bn_mul_param *mp)
+{
+    unsigned int h = an / 2, m = an - h, bn1 = bn - h;
+    unsigned int len = max(h, bn1);
+    bn_data *sa = ws, *sb = sa + m + 1, *t = sb + m + 1;
+    bn_data *next = t + 2 * m + 2;
+
+    /* sa = A0 + A1, sb = B0 + B1, both padded to m + 1 limbs */
+    sa[m] = bn_add_nm(sa, a + h, m, a, h);
+    if (bn1 >= h)
+        sb[len] = bn_add_nm(sb, b + h, bn1, b, h);
+    else
+        sb[len] = bn_add_nm(sb, b, h, b + h, bn1);
+    memset(sb + len + 1, 0, sizeof(bn_data) * (m - len));
+
+    struct bn_mul_job job[] = {
+        {.r = t, .a = sa, .an = m + 1, .b = sb, .bn = m + 1},
+        {.r = r, .a = a, .an = h, .b = b, .bn = h},
+        {.r = r + 2 * h, .a = a + h, .an = m, .b = b + h, .bn = bn1},
+    };
+    bn_mul_jobs(job, ARRAY_SIZE(job), an, next, mp);
+    bn_karatsuba_fold(r, an + bn, h, t, 2 * m + 2);
+}
+
+/*
+ * Evaluate X = X2 * t^2 + X1 * t + X0 at t = 1, -1, -2, X2 has n2 limbs.
+ * The values at -1 and -2 are stored as magnitudes, and their signs are
+ * returned in bit 0 and bit 1 respectively.
+ */
+static int bn_toom3_eval(bn_data *e1,
+                         bn_data *em1,
+                         bn_data *em2,
+                         const bn_data *x,
+                         unsigned int k,
+                         unsigned int n2,
+                         bn_data *tmp)
+{
+    const bn_data *x1 = x + k, *x2 = x + 2 * k;
+    bn_data *p = tmp, *q = tmp + k + 1;
+    int sign = 0;
+
+    /* p = X0 + X2 */
+    p[k] = bn_add_nm(p, x, k, x2, n2);
+    e1[k] = p[k] + bn_add_n(e1, p, x1, k);
+    if (p[k] || bn_cmp_n(p, x1, k) >= 0) {
+        em1[k] = p[k] - bn_sub_n(em1, p, x1, k);
+    } else {
+        bn_sub_n(em1, x1, p, k);
+        em1[k] = 0;
+        sign |= 1;
     }
-    memset(c->num, 0, sizeof(bn_data) * c->size);
-    bn_resize(c, csize);
 
+    /* p = X0 + 4 * X2, q = 2 * X1 */
+    p[n2] = bn_lshift_n(p, x2, n2, 2);
+    memset(p + n2 + 1, 0, sizeof(bn_data) * (k - n2));
+    p[k] += bn_add_n(p, p, x, k);
+    q[k] = bn_lshift_n(q, x1, k, 1);
+    if (bn_cmp_n(p, q, k + 1) >= 0) {
+        bn_sub_n(em2, p, q, k + 1);
+    } else {
+        bn_sub_n(em2, q, p, k + 1);
+        sign |= 2;
+    }
+    return sign;
+}
 
+/*
+ * Recover the coefficients of R = r4 * x^4 + ... + r0 from its values at
+ * 0, 1, -1, -2 and infinity, stored as consecutive w-limb two's complement
+ * numbers starting at v. x = 2^(BN_BIT * k) and R has rn limbs.
+ */
+static void bn_toom3_interpolate(bn_data *r,
+                                 unsigned int rn,
+                                 unsigned int k,
+                                 bn_data *v)
+{
+    unsigned int w = 2 * k + 2, n4 = rn - 4 * k;
+    bn_data *v0 = v, *v1 = v0 + w, *vm1 = v1 + w, *vm2 = vm1 + w;
+    bn_data *vinf = vm2 + w;
 
-    for (int i = 0; i < a->size; i++) {
-        u_bn_data_tmp carry = 0;
-        for (int j = 0; j < b->size; j++) {
-            u_bn_data_tmp t = (u_bn_data_tmp) c->num[i + j] +
-                              (u_bn_data_tmp) a->num[i] * b->num[j] + carry;
-            c->num[i + j] = (bn_data) t;
-            carry = t >> BN_BIT;
+    v0[2 * k] = v0[2 * k + 1] = 0;
+    memset(vinf + n4, 0, sizeof(bn_data) * (w - n4));
+
+    /* r3 = (r(-2) - r(1)) / 3 */
+    bn_sub_n(vm2, vm2, v1, w);
+    bn_divexact_3(vm2, vm2, w);
+    /* r1 = (r(1) - r(-1)) / 2 */
+    bn_sub_n(v1, v1, vm1, w);
+    bn_rshift1_signed(v1, w);
+    /* r2 = r(-1) - r(0) */
+    bn_sub_n(vm1, vm1, v0, w);
+    /* r3 = (r2 - r3) / 2 + 2 * r(inf) */
+    bn_sub_n(vm2, vm1, vm2, w);
+    bn_rshift1_signed(vm2, w);
+    bn_add_n(vm2, vm2, vinf, w);
+    bn_add_n(vm2, vm2, vinf, w);
+    /* r2 = r2 + r1 - r(inf) */
+    bn_add_n(vm1, vm1, v1, w);
+    bn_sub_n(vm1, vm1, vinf, w);
+    /* r1 = r1 - r3 */
+    bn_sub_n(v1, v1, vm2, w);
+
+    memcpy(r, v0, sizeof(bn_data) * 2 * k);
+    memset(r + 2 * k, 0, sizeof(bn_data) * 2 * k);
+    memcpy(r + 4 * k, vinf, sizeof(bn_data) * n4);
+    bn_add_nm(r + k, r + k, rn - k, v1, min(w, rn - k));
+    bn_add_nm(r + 2 * k, r + 2 * k, rn - 2 * k, vm1, min(w, rn - 2 * k));
+    bn_add_nm(r + 3 * k, r + 3 * k, rn - 3 * k, vm2, min(w, rn - 3 * k));
+}
+
+/*
+ * R = A * B, assume an >= bn > 2 * ceil(an / 3)
+ * Evaluate at 0, 1, -1, -2 and infinity, then interpolate in two's complement
+ * over w limbs, which is wide enough for every intermediate value.
+ */
+static void bn_mul_toom3(bn_data *r,
+                         const bn_data *a,
+                         unsigned int an,
+                         const bn_data *b,
+                         unsigned int bn,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp)
+{
+    unsigned int k = (an + 2) / 3, w = 2 * k + 2;
+    unsigned int an2 = an - 2 * k, bn2 = bn - 2 * k;
+    bn_data *ea1 = ws, *eam1 = ea1 + k + 1, *eam2 = eam1 + k + 1;
+    bn_data *eb1 = eam2 + k + 1, *ebm1 = eb1 + k + 1, *ebm2 = ebm1 + k + 1;
+    bn_data *v0 = ebm2 + k + 1, *v1 = v0 + w, *vm1 = v1 + w, *vm2 = vm1 + w;
+    bn_data *vinf = vm2 + w, *next = vinf + w;
+
+    int sign = bn_toom3_eval(ea1, eam1, eam2, a, k, an2, v0);
+    sign ^= bn_toom3_eval(eb1, ebm1, ebm2, b, k, bn2, v0);
+
+    struct bn_mul_job job[] = {
+        {.r = v0, .a = a, .an = k, .b = b, .bn = k},
+        {.r = v1, .a = ea1, .an = k + 1, .b = eb1, .bn = k + 1},
+        {.r = vm1, .a = eam1, .an = k + 1, .b = ebm1, .bn = k + 1},
+        {.r = vm2, .a = eam2, .an = k + 1, .b = ebm2, .bn = k + 1},
+        {.r = vinf, .a = a + 2 * k, .an = an2, .b = b + 2 * k, .bn = bn2},
+    };
+    bn_mul_jobs(job, ARRAY_SIZE(job), an, next, mp);
+    if (sign & 1)
+        bn_neg_n(vm1, vm1, w);
+    if (sign & 2)
+        bn_neg_n(vm2, vm2, w);
+    bn_toom3_interpolate(r, an + bn, k, v0);
+}
+
+/*
+ * R = A * B, R has an + bn limbs and overlaps neither A nor B.
+ * ws provides bn_mul_itch(max(an, bn)) limbs of scratch.
+ */
+#if BN_BIT == 64
+/*
+ * Number theoretic transform multiplication. Limbs are convolved modulo
+ * three primes p = c * 2^k + 1 below 2^62 and the coefficients, which stay
+ * below n * 2^128, are put back together by the CRT from p0 * p1 * p2 >
+ * 2^184. Transforms go up to 2^54 points, beyond any unsigned int operand.
+ * Everything is integer arithmetic, with Montgomery multiplication, so it
+ * runs in the kernel without touching the FPU.
+ */
+#define BN_NTT_PRIMES 3
+
+struct bn_ntt_prime {
+    bn_data p;
+    bn_data pinv; /* -1 / p mod 2^64 */
+    bn_data r2;   /* 2^128 mod p */
+    bn_data g;    /* generator of the multiplicative group */
+};
+
+static const struct bn_ntt_prime bn_ntt_primes[BN_NTT_PRIMES] = {
+    {0x3a00000000000001ULL, 0x39ffffffffffffffULL, 0x1a11a7b9611a7baaULL, 3},
+    {0x2280000000000001ULL, 0x227fffffffffffffULL, 0x1b67e2519f8946b6ULL, 5},
+    {0x2c40000000000001ULL, 0x2c3fffffffffffffULL, 0x22f5e02e4850feb0ULL, 7},
+};
+
+/* CRT constants in Montgomery form, 1 / p0 mod p1, 1 / p0 and 1 / p1 mod p2 */
+#define BN_NTT_INV01 0x16c15c9882b93111ULL
+#define BN_NTT_INV02 0x073dac37dac37dbfULL
+#define BN_NTT_INV12 0x158ec4ec4ec4ec35ULL
+
+/* p0 * p1 */
+#define BN_NTT_P01_HI 0x07d1000000000000ULL
+#define BN_NTT_P01_LO 0x5c80000000000001ULL
+
+/* T / 2^64 mod p for T < p * 2^64 */
+static inline bn_data bn_ntt_redc(u_bn_data_tmp t, const struct bn_ntt_prime *q)
+{
+    bn_data m = (bn_data) t * q->pinv;
+    bn_data r = (t + (u_bn_data_tmp) m * q->p) >> BN_BIT;
+    return r >= q->p ? r - q->p : r;
+}
+
+/* A * B / 2^64 mod p, A may be any limb if B < p */
+static inline bn_data bn_ntt_mul(bn_data a,
+                                 bn_data b,
+                                 const struct bn_ntt_prime *q)
+{
+    return bn_ntt_redc((u_bn_data_tmp) a * b, q);
+}
+
+static inline bn_data bn_ntt_add(bn_data a, bn_data b, bn_data p)
+{
+    bn_data t = a + b;
+    return t >= p ? t - p : t;
+}
+
+static inline bn_data bn_ntt_sub(bn_data a, bn_data b, bn_data p)
+{
+    return a >= b ? a - b : a + p - b;
+}
+
+/* W[j] = w^j for j < len / 2, w a primitive len-th root, Montgomery form */
+static void bn_ntt_twiddles(bn_data *w, size_t len, const struct bn_ntt_prime *q)
+{
+    bn_data g = bn_ntt_mul(q->g, q->r2, q);
+    bn_data root = bn_ntt_redc(q->r2, q);
+    bn_data one = root;
+
+    for (bn_data e = (q->p - 1) / len; e; e >>= 1) {
+        if (e & 1)
+            root = bn_ntt_mul(root, g, q);
+        g = bn_ntt_mul(g, g, q);
+    }
+
+    w[0] = one;
+    for (size_t j = 1; j < len / 2; j++)
+        w[j] = bn_ntt_mul(w[j - 1], root, q);
+}
+
+/*
+ * Decimation in frequency, natural order in, bit reversed order out. w^0 is
+ * 1, which saves the multiplications of the last stages.
+ */
+static void bn_ntt_forward(bn_data *x,
+                           size_t len,
+                           const bn_data *w,
+                           const struct bn_ntt_prime *q)
+{
+    for (size_t h = len / 2, s = 1; h; h >>= 1, s <<= 1) {
+        for (size_t i = 0; i < len; i += 2 * h) {
+            bn_data u = x[i], v = x[i + h];
+            x[i] = bn_ntt_add(u, v, q->p);
+            x[i + h] = bn_ntt_sub(u, v, q->p);
+            for (size_t j = 1; j < h; j++) {
+                u = x[i + j];
+                v = x[i + j + h];
+                x[i + j] = bn_ntt_add(u, v, q->p);
+                x[i + j + h] = bn_ntt_mul(bn_ntt_sub(u, v, q->p), w[j * s], q);
+            }
         }
-        c->num[i + b->size] = (bn_data) carry;
     }
+}
 
-    while (csize > 1 && c->num[csize - 1] == 0)
-        csize--;
-    if (csize != c->size)
-        bn_resize(c, csize);
+/*
+ * Decimation in time with the inverse roots, bit reversed order in, natural
+ * order out, without the 1 / len factor. w^-j is -w^(len / 2 - j).
+ */
+static void bn_ntt_inverse(bn_data *x,
+                           size_t len,
+                           const bn_data *w,
+                           const struct bn_ntt_prime *q)
+{
+    for (size_t h = 1, s = len / 2; h < len; h <<= 1, s >>= 1) {
+        for (size_t i = 0; i < len; i += 2 * h) {
+            bn_data u = x[i], v = x[i + h];
+            x[i] = bn_ntt_add(u, v, q->p);
+            x[i + h] = bn_ntt_sub(u, v, q->p);
+            for (size_t j = 1; j < h; j++) {
+                u = x[i + j];
+                v = bn_ntt_mul(x[i + j + h], q->p - w[len / 2 - j * s], q);
+                x[i + j] = bn_ntt_add(u, v, q->p);
+                x[i + j + h] = bn_ntt_sub(u, v, q->p);
+            }
+        }
+    }
+}
 
-    c->sign = a->sign ^ b->sign;
+/* X = A mod p in Montgomery form, zero padded to len */
+static void bn_ntt_load(bn_data *x,
+                        size_t len,
+                        const bn_data *a,
+                        unsigned int an,
+                        const struct bn_ntt_prime *q)
+{
+    for (unsigned int i = 0; i < an; i++)
+        x[i] = bn_ntt_mul(a[i], q->r2, q);
+    memset(x + an, 0, sizeof(bn_data) * (len - an));
+}
+
+/* The cyclic convolution of A and B modulo one prime, B == NULL squares A */
+struct bn_ntt_job {
+    const struct bn_ntt_prime *q;
+    bn_data *x; /* A, then the result */
+    bn_data *y; /* B */
+    bn_data *w; /* twiddles */
+    const bn_data *a, *b;
+    unsigned int an, bn;
+    size_t len;
+};
 
-    if (tmp) {
-        bn_free(tmp);
-        *tmp = *c;
+static void bn_ntt_job_run(void *arg)
+{
+    struct bn_ntt_job *j = arg;
+    const struct bn_ntt_prime *q = j->q;
+    /* len divides p - 1, so 1 / len = -(p - 1) / len */
+    bn_data len_inv = q->p - (q->p - 1) / j->len;
+    const bn_data *y = j->x;
+
+    bn_ntt_twiddles(j->w, j->len, q);
+    bn_ntt_load(j->x, j->len, j->a, j->an, q);
+    bn_ntt_forward(j->x, j->len, j->w, q);
+    if (j->b) {
+        bn_ntt_load(j->y, j->len, j->b, j->bn, q);
+        bn_ntt_forward(j->y, j->len, j->w, q);
+        y = j->y;
+    }
+
+    /*
+     * Scaling by the plain 1 / len also leaves Montgomery form, and the
+     * inverse transform keeps it that way
+     */
+    for (size_t i = 0; i < j->len; i++)
+        j->x[i] = bn_ntt_mul(bn_ntt_mul(j->x[i], y[i], q), len_inv, q);
+    bn_ntt_inverse(j->x, j->len, j->w, q);
+}
+
+/* R = the n coefficients with residues X[i], X[len + i], X[2 * len + i] */
+static void bn_ntt_crt(bn_data *r, const bn_data *x, size_t len, unsigned int n)
+{
+    const struct bn_ntt_prime *q1 = &bn_ntt_primes[1], *q2 = &bn_ntt_primes[2];
+    bn_data p0 = bn_ntt_primes[0].p;
+    bn_data c0 = 0, c1 = 0;
+
+    for (unsigned int i = 0; i < n; i++) {
+        bn_data x0 = x[i], x1 = x[len + i], x2 = x[2 * len + i];
+
+        /* Garner, X = x0 + p0 * y1 + p0 * p1 * y2, p0 < 2 * p1, 2 * p2 */
+        bn_data t = x0 >= q1->p ? x0 - q1->p : x0;
+        bn_data y1 = bn_ntt_mul(bn_ntt_sub(x1, t, q1->p), BN_NTT_INV01, q1);
+        t = x0 >= q2->p ? x0 - q2->p : x0;
+        t = bn_ntt_mul(bn_ntt_sub(x2, t, q2->p), BN_NTT_INV02, q2);
+        bn_data y2 = bn_ntt_mul(bn_ntt_sub(t, y1, q2->p), BN_NTT_INV12, q2);
+
+        /* add X < 2^185 to the carry and shift a limb out */
+        u_bn_data_tmp u = (u_bn_data_tmp) p0 * y1 + x0;
+        u_bn_data_tmp lo = (u_bn_data_tmp) y2 * BN_NTT_P01_LO;
+        u_bn_data_tmp hi = (u_bn_data_tmp) y2 * BN_NTT_P01_HI;
+        u_bn_data_tmp acc = (u_bn_data_tmp) c0 + (bn_data) u + (bn_data) lo;
+        r[i] = acc;
+        acc >>= BN_BIT;
+        acc += (u_bn_data_tmp) c1 + (u >> BN_BIT) + (lo >> BN_BIT) + (bn_data) hi;
+        c0 = acc;
+        c1 = (acc >> BN_BIT) + (hi >> BN_BIT);
+    }
+}
+
+/*
+ * R = A * B, R has an + bn limbs, B == NULL squares A with one forward
+ * transform per prime. From the split threshold on the primes go to
+ * bn_par_run, each with its own slice of ws.
+ */
+static void bn_mul_ntt(bn_data *r,
+                       const bn_data *a,
+                       unsigned int an,
+                       const bn_data *b,
+                       unsigned int bn,
+                       bn_data *ws,
+                       const struct bn_mul_param *mp)
+{
+    size_t len = bn_ntt_len((size_t) an + bn);
+    bool par = an >= mp->split;
+    struct bn_ntt_job job[BN_NTT_PRIMES];
+    void *arg[BN_NTT_PRIMES];
+    bn_data *y = ws + BN_NTT_PRIMES * len;
+
+    for (unsigned int i = 0; i < BN_NTT_PRIMES; i++) {
+        job[i] = (struct bn_ntt_job){
+            .q = &bn_ntt_primes[i],
+            .x = ws + i * len,
+            .y = y,
+            .w = y + len,
+            .a = a,
+            .b = b,
+            .an = an,
+            .bn = bn,
+            .len = len,
+        };
+        arg[i] = &job[i];
+        if (par)
+            y += len + len / 2;
+    }
+
+    if (par) {
+        bn_par_run(bn_ntt_job_run, arg, BN_NTT_PRIMES);
+    } else {
+        for (unsigned int i = 0; i < BN_NTT_PRIMES; i++)
+            bn_ntt_job_run(&job[i]);
+    }
+    bn_ntt_crt(r, ws, len, an + bn);
+}
+#endif
+
+static void bn_mul_limbs(bn_data *r,
+                         const bn_data *a,
+                         unsigned int an,
+                         const bn_data *b,
+                         unsigned int bn,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp)
+{
+    if (an < bn) {
+        swap(a, b);
+        swap(an, bn);
+    }
+
+    if (bn < mp->karatsuba)
+        bn_mul_basecase(r, a, an, b, bn);
+#if BN_BIT == 64
+    else if (bn >= mp->ntt)
+        bn_mul_ntt(r, a, an, b, bn, ws, mp);
+#endif
+    else if (2 * bn <= an)
+        bn_mul_unbalanced(r, a, an, b, bn, ws, mp);
+    else if (bn >= mp->toom3 && bn > 2 * ((an + 2) / 3))
+        bn_mul_toom3(r, a, an, b, bn, ws, mp);
+    else
+        bn_mul_karatsuba(r, a, an, b, bn, ws, mp);
+}
+
+/* R = A^2, R has 2n limbs, each cross product is computed once */
+static void bn_sqr_basecase(bn_data *r, const bn_data *a, unsigned int n)
+{
+    r[0] = 0;
+    r[2 * n - 1] = 0;
+    if (n > 1) {
+        r[n] = bn_mul_1(r + 1, a + 1, n - 1, a[0]);
+        for (unsigned int i = 1; i < n - 1; i++)
+            r[n + i] = bn_addmul_1(r + 2 * i + 1, a + i + 1, n - i - 1, a[i]);
+        bn_lshift_n(r, r, 2 * n, 1);
+    }
+
+    /* add the diagonal a[i]^2 */
+    u_bn_data_tmp carry = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        u_bn_data_tmp sq = (u_bn_data_tmp) a[i] * a[i];
+        carry += (u_bn_data_tmp) r[2 * i] + (bn_data) sq;
+        r[2 * i] = carry;
+        carry >>= BN_BIT;
+        carry += (u_bn_data_tmp) r[2 * i + 1] + (bn_data) (sq >> BN_BIT);
+        r[2 * i + 1] = carry;
+        carry >>= BN_BIT;
     }
 }
 
-void bn_lshift(bn *src, unsigned int shift)
+/* R = A^2, the squaring counterpart of bn_mul_karatsuba() */
+static void bn_sqr_karatsuba(bn_data *r,
+                             const bn_data *a,
+                             unsigned int n,
+                             bn_data *ws,
+                             const struct bn_mul_param *mp)
+{
+    unsigned int h = n / 2, m = n - h;
+    bn_data *sa = ws, *t = sa + m + 1, *next = t + 2 * m + 2;
+
+    sa[m] = bn_add_nm(sa, a + h, m, a, h);
+    struct bn_mul_job job[] = {
+        {.r = t, .a = sa, .an = m + 1},
+        {.r = r, .a = a, .an = h},
+        {.r = r + 2 * h, .a = a + h, .an = m},
+    };
+    bn_mul_jobs(job, ARRAY_SIZE(job), n, next, mp);
+    bn_karatsuba_fold(r, 2 * n, h, t, 2 * m + 2);
+}
+
+/* R = A^2, the squaring counterpart of bn_mul_toom3() */
+static void bn_sqr_toom3(bn_data *r,
+                         const bn_data *a,
+                         unsigned int n,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp)
+{
+    unsigned int k = (n + 2) / 3, w = 2 * k + 2, n2 = n - 2 * k;
+    bn_data *e1 = ws, *em1 = e1 + k + 1, *em2 = em1 + k + 1;
+    bn_data *v0 = em2 + k + 1, *v1 = v0 + w, *vm1 = v1 + w, *vm2 = vm1 + w;
+    bn_data *vinf = vm2 + w, *next = vinf + w;
+
+    /* squares are non-negative, the signs do not matter */
+    bn_toom3_eval(e1, em1, em2, a, k, n2, v0);
+
+    struct bn_mul_job job[] = {
+        {.r = v0, .a = a, .an = k},
+        {.r = v1, .a = e1, .an = k + 1},
+        {.r = vm1, .a = em1, .an = k + 1},
+        {.r = vm2, .a = em2, .an = k + 1},
+        {.r = vinf, .a = a + 2 * k, .an = n2},
+    };
+    bn_mul_jobs(job, ARRAY_SIZE(job), n, next, mp);
+    bn_toom3_interpolate(r, 2 * n, k, v0);
+}
+
+/*
+ * R = A^2, R has 2n limbs and does not overlap A.
+ * ws provides bn_mul_itch(n) limbs of scratch.
+ */
+static void bn_sqr_limbs(bn_data *r,
+                         const bn_data *a,
+                         unsigned int n,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp)
+{
+    if (n < mp->karatsuba)
+        bn_sqr_basecase(r, a, n);
+#if BN_BIT == 64
+    else if (n >= mp->ntt)
+        bn_mul_ntt(r, a, n, NULL, n, ws, mp);
+#endif
+    else if (n >= mp->toom3)
+        bn_sqr_toom3(r, a, n, ws, mp);
+    else
+        bn_sqr_karatsuba(r, a, n, ws, mp);
+}
+
+/* Scratch limbs reused across multiplications */
+struct bn_ws {
+    bn_data *p;
+    size_t n;
+    struct bn_arena *arena;
+};
+
+static bn_data *bn_ws_get(struct bn_ws *ws, size_t n)
+{
+    if (n <= ws->n)
+        return ws->p;
+
+    n = max(n, 2 * ws->n);
+    bn_mem_free(ws->arena, ws->p);
+    ws->p = bn_mem_alloc(ws->arena, sizeof(bn_data) * n);
+    ws->n = ws->p ? n : 0;
+    return ws->p;
+}
+
+/*
+ * C = A * B using the scratch in ws. When C aliases an operand, the product
+ * is built in scratch and copied back. On -ENOMEM C is left as it was.
+ */
+static int bn_mul_ws(bn *c, const bn *a, const bn *b, struct bn_ws *ws)
+{
+    struct bn_mul_param mp;
+    bn_mul_param_get(&mp);
+    if (a->size < b->size)
+        swap(a, b);
+    unsigned int csize = a->size + b->size;
+    unsigned int sign = a->sign ^ b->sign;
+    bool alias = c == a || c == b;
+
+    size_t itch = bn_mul_itch(a->size, &mp);
+    size_t need = alias ? csize : 0;
+    bn_data *w = bn_ws_get(ws, itch + need);
+    if (!w && itch) {
+        /* schoolbook needs no scratch */
+        mp.karatsuba = UINT_MAX;
+        itch = 0;
+        w = bn_ws_get(ws, need);
+    }
+    if (!w && need)
+        return -ENOMEM;
+
+    /* an aliased C only grows after the operands have been read */
+    bn_data *r = w + itch;
+    if (!alias) {
+        if (bn_resize(c, csize))
+            return -ENOMEM;
+        r = c->num;
+    } else if (bn_reserve(c, csize)) {
+        return -ENOMEM;
+    }
+    if (a == b)
+        bn_sqr_limbs(r, a->num, a->size, w, &mp);
+    else
+        bn_mul_limbs(r, a->num, a->size, b->num, b->size, w, &mp);
+
+    while (csize > 1 && r[csize - 1] == 0)
+        csize--;
+    bn_resize(c, csize);
+    if (alias)
+        memcpy(c->num, r, sizeof(bn_data) * csize);
+    c->sign = sign;
+    return 0;
+}
+
+/* C = A * B */
+int bn_mult(bn *c, const bn *a, const bn *b)
+{
+    struct bn_ws ws = {NULL, 0, c->arena};
+    int ret = bn_mul_ws(c, a, b, &ws);
+    bn_mem_free(ws.arena, ws.p);
+    return ret;
+}
+
+/* C = A * A, C may alias A */
+int bn_sqr(bn *c, const bn *a)
+{
+    return bn_mult(c, a, a);
+}
+
+int bn_lshift(bn *src, unsigned int shift)
 {
     shift %= BN_BIT;
     if (!shift)
-        return;
+        return 0;
 
     unsigned int lzeros = bn_clz(src);
 
-    bn_resize(src, src->size + (shift > lzeros));
+    if (bn_resize(src, src->size + (shift > lzeros)))
+        return -ENOMEM;
 
     for (int i = src->size - 1; i > 0; i--)
         src->num[i] =
             src->num[i] << shift | src->num[i - 1] >> (BN_BIT - shift);
     src->num[0] <<= shift;
+    return 0;
 }
 
-char *bn_to_string(const bn *p)
+/*
+ * Decimal conversion works in chunks of BN_DEC_DIGITS digits, the largest
+ * power of ten that fits in a limb. BN_DEC_INV is the reciprocal of the
+ * divisor normalized by BN_DEC_SHIFT, floor((B^2 - 1) / (BASE << SHIFT)) - B.
+ */
+#if BN_BIT == 64
+#define BN_DEC_DIGITS 19
+#define BN_DEC_BASE 10000000000000000000ULL
+#define BN_DEC_SHIFT 0
+#define BN_DEC_INV 0xd83c94fb6d2ac34aULL
+#else
+#define BN_DEC_DIGITS 9
+#define BN_DEC_BASE 1000000000U
+#define BN_DEC_SHIFT 2
+#define BN_DEC_INV 0x12e0be82U
+#endif
+
+/* Below this many limbs, chunked division beats divide-and-conquer */
+#define BN_DEC_DC_THRESHOLD 80
+
+/* Levels of 10^(BN_DEC_DIGITS * 2^i), enough for 2^32 limbs */
+#define BN_DEC_LEVELS 32
+
+struct bn_dec_pow {
+    bn_data *p;  /* 10^digits */
+    bn_data *mu; /* floor(B^(2 * pn) / p), pn + 1 limbs */
+    unsigned int pn;
+    size_t digits;
+};
+
+/*
+ * Q = A / BN_DEC_BASE, return A % BN_DEC_BASE, Q may alias A.
+ * Division by the invariant divisor is done by multiplying with its
+ * precomputed reciprocal (Moller-Granlund), so no 128-bit division is needed.
+ */
+static bn_data bn_divrem_dec(bn_data *q, const bn_data *a, unsigned int n)
 {
-    /* log10(x) = log2(x) / log2(10) ~= log2(x) / 3.32 */
-    unsigned int len = BN_BIT * p->size / 3 + 2;
-    char *s = kmalloc(sizeof(char) * len, GFP_KERNEL);
-    memset(s, '0', len - 1);
-    s[len - 1] = '\0';
+    const bn_data d = (bn_data) BN_DEC_BASE << BN_DEC_SHIFT;
+    bn_data r = 0;
 
-    for (int i = p->size - 1; i >= 0; i--) {
-        for (bn_data n = (bn_data) 1 << (BN_BIT - 1); n; n >>= 1) {
-            int carry = !!(n & p->num[i]);
-            for (int j = len - 2; j >= 0; j--) {
-                s[j] += s[j] - '0' + carry;  // multiply by 2
-                carry = (s[j] > '9');
-                s[j] -= 10 & -carry;
-            }
+    while (n--) {
+        bn_data nh = r << BN_DEC_SHIFT |
+                     (a[n] >> 1) >> (BN_BIT - 1 - BN_DEC_SHIFT);
+        bn_data nl = a[n] << BN_DEC_SHIFT;
+        u_bn_data_tmp t = (u_bn_data_tmp) nh * BN_DEC_INV +
+                          ((u_bn_data_tmp) (nh + 1) << BN_BIT | nl);
+        bn_data qh = t >> BN_BIT, ql = t;
+        r = nl - qh * d;
+        if (r > ql) {
+            qh--;
+            r += d;
+        }
+        if (r >= d) {
+            qh++;
+            r -= d;
+        }
+        q[n] = qh;
+        r >>= BN_DEC_SHIFT;
+    }
+    return r;
+}
+
+/* Write A into s[0..len) zero padded, A has n limbs and is destroyed */
+static void bn_dec_basecase(char *s, size_t len, bn_data *a, unsigned int n)
+{
+    char *p = s + len;
+
+    while (n && p > s) {
+        bn_data r = bn_divrem_dec(a, a, n);
+        if (!a[n - 1])
+            n--;
+        for (int i = 0; i < BN_DEC_DIGITS && p > s; i++) {
+            *--p = '0' + r % 10;
+            r /= 10;
         }
     }
+    memset(s, '0', p - s);
+}
+
+/*
+ * Q = A / P, R = A % P by Barrett reduction, A has an limbs,
+ * P <= A < B^(2 * pn). Q gets an - pn + 1 limbs and R gets pn limbs.
+ */
+static void bn_divrem_barrett(bn_data *q,
+                              bn_data *r,
+                              const bn_data *a,
+                              unsigned int an,
+                              const struct bn_dec_pow *pw,
+                              bn_data *ws,
+                              const struct bn_mul_param *mp)
+{
+    unsigned int m = pw->pn, qn = an - m + 1;
+    bn_data *t = ws, *next = t + 2 * m + 2;
+
+    /* Q = floor(floor(A / B^(m - 1)) * mu / B^(m + 1)), at most 2 short */
+    bn_mul_limbs(t, a + m - 1, qn, pw->mu, m + 1, next, mp);
+    memcpy(q, t + m + 1, sizeof(bn_data) * qn);
+
+    bn_mul_limbs(t, q, qn, pw->p, m, next, mp);
+    bn_sub_n(t, a, t, an);
+    t[an] = 0;
+    while (t[m] || bn_cmp_n(t, pw->p, m) >= 0) {
+        t[m] -= bn_sub_n(t, t, pw->p, m);
+        bn_add_1(q, q, qn, 1);
+    }
+    memcpy(r, t, sizeof(bn_data) * m);
+}
+
+/*
+ * Compute pw->mu = floor(B^(2 * pn) / pw->p), starting from an estimate
+ * that must not exceed it. Each round divides the remainder
+ * B^(2 * pn) - p * mu by p with the current estimate, which roughly doubles
+ * the number of correct limbs, like a Newton iteration.
+ */
+static void bn_dec_reciprocal(struct bn_dec_pow *pw,
+                              bn_data *ws,
+                              const struct bn_mul_param *mp)
+{
+    unsigned int m = pw->pn;
+    bn_data *x = pw->mu, *t = ws, *rem = t + 2 * m + 1, *c = rem + 2 * m + 1;
+    bn_data *next = c + 2 * m + 3;
+
+    for (;;) {
+        /* rem = B^(2m) - p * x, which is never negative */
+        bn_mul_limbs(t, x, m + 1, pw->p, m, next, mp);
+        bn_neg_n(rem, t, 2 * m + 1);
+        rem[2 * m]++;
+
+        unsigned int rn = 2 * m + 1;
+        while (rn > m && !rem[rn - 1])
+            rn--;
+        if (rn == m && bn_cmp_n(rem, pw->p, m) < 0)
+            break;
+
+        /* c = floor(floor(rem / B^(m - 1)) * x / B^(m + 1)) <= rem / p */
+        bn_mul_limbs(c, rem + m - 1, m + 2, x, m + 1, next, mp);
+        bn_data *cq = c + m + 1;
+        unsigned int cn = m + 1;
+        while (cn && !cq[cn - 1])
+            cn--;
+        if (!cn)
+            bn_add_1(x, x, m + 1, 1);
+        else
+            bn_add_n(x, x, cq, m + 1);
+    }
+}
+
+/*
+ * Build 10^(BN_DEC_DIGITS * 2^i) and their reciprocals until the next power
+ * exceeds A, return the highest level, or -1 if out of memory.
+ */
+static int bn_dec_pow_init(struct bn_dec_pow *pw,
+                           const bn_data *a,
+                           unsigned int n,
+                           bn_data *ws,
+                           const struct bn_mul_param *mp,
+                           struct bn_arena *ar)
+{
+    int i = 0;
+
+    pw[0].pn = 1;
+    pw[0].digits = BN_DEC_DIGITS;
+    pw[0].p = bn_mem_alloc(ar, sizeof(bn_data) * 3);
+    if (!pw[0].p)
+        return -1;
+    pw[0].mu = pw[0].p + 1;
+    pw[0].p[0] = BN_DEC_BASE;
+    pw[0].mu[0] = 0;
+    pw[0].mu[1] = 1;
+    bn_dec_reciprocal(&pw[0], ws, mp);
+
+    for (;; i++) {
+        unsigned int m = pw[i].pn, pn = 2 * m;
+        bn_data *p = bn_mem_alloc(ar, sizeof(bn_data) * (2 * pn + 1));
+        if (!p) {
+            for (; i >= 0; i--)
+                bn_mem_free(ar, pw[i].p);
+            return -1;
+        }
+        bn_sqr_limbs(p, pw[i].p, m, ws, mp);
+        pn -= !p[pn - 1];
+        if (i + 1 == BN_DEC_LEVELS || n < pn ||
+            (n == pn && bn_cmp_n(a, p, n) < 0)) {
+            bn_mem_free(ar, p);
+            return i;
+        }
+
+        /* (mu_i)^2 approximates B^(4m) / p from below */
+        bn_sqr_limbs(ws, pw[i].mu, m + 1, ws + 2 * m + 2, mp);
+        memcpy(p + pn, ws + 2 * (2 * m - pn), sizeof(bn_data) * (pn + 1));
+        pw[i + 1].p = p;
+        pw[i + 1].mu = p + pn;
+        pw[i + 1].pn = pn;
+        pw[i + 1].digits = 2 * pw[i].digits;
+        bn_dec_reciprocal(&pw[i + 1], ws, mp);
+    }
+}
+
+/*
+ * Write A into s[0..len) zero padded, A < 10^(2 * pw[level].digits) and is
+ * destroyed. Split A by 10^pw[level].digits and convert both halves.
+ */
+static void bn_dec_dc(char *s,
+                      size_t len,
+                      bn_data *a,
+                      unsigned int an,
+                      const struct bn_dec_pow *pw,
+                      int level,
+                      bn_data *ws,
+                      const struct bn_mul_param *mp)
+{
+    while (an > 1 && !a[an - 1])
+        an--;
+    if (level < 0 || an < BN_DEC_DC_THRESHOLD) {
+        bn_dec_basecase(s, len, a, an);
+        return;
+    }
+
+    const struct bn_dec_pow *p = pw + level;
+    unsigned int m = p->pn;
+    size_t lo = p->digits;
+    if (an < m || (an == m && bn_cmp_n(a, p->p, m) < 0)) {
+        memset(s, '0', len - lo);
+        bn_dec_dc(s + len - lo, lo, a, an, pw, level - 1, ws, mp);
+        return;
+    }
+
+    bn_data *q = ws, *r = q + an - m + 1, *next = r + m;
+    bn_divrem_barrett(q, r, a, an, p, next, mp);
+    bn_dec_dc(s, len - lo, q, an - m + 1, pw, level - 1, next, mp);
+    bn_dec_dc(s + len - lo, lo, r, m, pw, level - 1, next, mp);
+}
+
+/*
+ * s[1..len] holds zero padded digits, strip the padding, add the sign and
+ * move the string to the start of s, return its length
+ */
+static size_t bn_dec_trim(char *s, size_t len, unsigned int sign)
+{
+    s[len + 1] = '\0';
 
     // leading zeros
     char *s_tmp;
-    for (s_tmp = s; *s_tmp == '0' && *(s_tmp + 1) != '\0'; s_tmp++, len--)
+    for (s_tmp = s + 1; *s_tmp == '0' && *(s_tmp + 1) != '\0'; s_tmp++, len--)
         ;
-    if (p->sign) {
+    if (sign) {
         *(--s_tmp) = '-';
         len++;
     }
+    memmove(s, s_tmp, len + 1);
+    return len;
+}
 
-    memmove(s, s_tmp, len);
+size_t bn_to_string_inline(const bn *p, char *buf)
+{
+    bn_data t[BN_INLINE];
+    unsigned int n = min(p->size, (unsigned int) BN_INLINE);
+
+    memcpy(t, p->num, sizeof(bn_data) * n);
+    bn_dec_basecase(buf + 1, BN_INLINE_STR - 2, t, n);
+    return bn_dec_trim(buf, BN_INLINE_STR - 2, p->sign);
+}
+
+/*
+ * Write A to s without leading zeros, return the digits written. A has an
+ * limbs and is destroyed, s has room for BN_BIT * an / 3 + 1 digits. Only
+ * the low halves are padded, so nothing has to be moved afterwards.
+ */
+static size_t bn_dec_top(char *s,
+                         bn_data *a,
+                         unsigned int an,
+                         const struct bn_dec_pow *pw,
+                         int level,
+                         bn_data *ws,
+                         const struct bn_mul_param *mp)
+{
+    while (an > 1 && !a[an - 1])
+        an--;
+    if (level < 0 || an < BN_DEC_DC_THRESHOLD) {
+        size_t len = (size_t) BN_BIT * an / 3 + 1, z = 0;
+
+        bn_dec_basecase(s, len, a, an);
+        while (z < len - 1 && s[z] == '0')
+            z++;
+        memmove(s, s + z, len - z);
+        return len - z;
+    }
+
+    const struct bn_dec_pow *p = pw + level;
+    unsigned int m = p->pn;
+    if (an < m || (an == m && bn_cmp_n(a, p->p, m) < 0))
+        return bn_dec_top(s, a, an, pw, level - 1, ws, mp);
+
+    bn_data *q = ws, *r = q + an - m + 1, *next = r + m;
+    bn_divrem_barrett(q, r, a, an, p, next, mp);
+    size_t hi = bn_dec_top(s, q, an - m + 1, pw, level - 1, next, mp);
+    bn_dec_dc(s + hi, p->digits, r, m, pw, level - 1, next, mp);
+    return hi + p->digits;
+}
+
+size_t bn_to_string_size(const bn *p)
+{
+    /* log10(x) = log2(x) / log2(10) ~= log2(x) / 3.32, sign and NUL */
+    return (size_t) BN_BIT * p->size / 3 + 3;
+}
+
+size_t bn_to_string_buf(const bn *p, char *buf, struct bn_arena *ar)
+{
+    struct bn_mul_param mp;
+    bn_mul_param_get(&mp);
+    struct bn_dec_pow pw[BN_DEC_LEVELS];
+    int level = -1;
+    unsigned int n = p->size;
+    while (n > 1 && !p->num[n - 1])
+        n--;
+
+    /* n limbs for a copy of A, the rest bounds the scratch of the steps */
+    size_t itch = n;
+    if (n >= BN_DEC_DC_THRESHOLD)
+        itch += 7 * (size_t) n + 64 + bn_mul_itch(n + 2, &mp);
+    bn_data *ws = bn_mem_alloc(ar, sizeof(bn_data) * itch);
+    if (!ws)
+        return 0;
+    memcpy(ws, p->num, sizeof(bn_data) * n);
+    if (n >= BN_DEC_DC_THRESHOLD)
+        level = bn_dec_pow_init(pw, ws, n, ws + n, &mp, ar);
+
+    char *s = buf;
+    if (p->sign)
+        *s++ = '-';
+    s += bn_dec_top(s, ws, n, pw, level, ws + n, &mp);
+    *s = '\0';
+
+    for (int i = 0; i <= level; i++)
+        bn_mem_free(ar, pw[i].p);
+    bn_mem_free(ar, ws);
+    return s - buf;
+}
+
+char *bn_to_string_arena(const bn *p, struct bn_arena *ar)
+{
+    char *s = bn_mem_alloc(ar, bn_to_string_size(p));
+
+    if (s && !bn_to_string_buf(p, s, ar)) {
+        bn_mem_free(ar, s);
+        s = NULL;
+    }
     return s;
 }
 
-void bn_fib(bn *p, long long k)
+char *bn_to_string(const bn *p)
+{
+    return bn_to_string_arena(p, p->arena);
+}
+
+size_t bn_to_hex_size(const bn *p)
+{
+    return (size_t) p->size * (BN_BIT / 4) + 2;
+}
+
+size_t bn_to_hex_buf(const bn *p, char *buf)
+{
+    static const char xdigit[] = "0123456789abcdef";
+    unsigned int n = p->size;
+    while (n > 1 && !p->num[n - 1])
+        n--;
+
+    char *q = buf;
+    if (p->sign)
+        *q++ = '-';
+    /* no leading zeros in the top limb, but keep at least one digit */
+    int shift = BN_BIT - 4;
+    while (shift > 0 && !(p->num[n - 1] >> shift))
+        shift -= 4;
+    for (int i = n - 1; i >= 0; i--, shift = BN_BIT - 4) {
+        for (; shift >= 0; shift -= 4)
+            *q++ = xdigit[(p->num[i] >> shift) & 0xf];
+    }
+    *q = '\0';
+    return q - buf;
+}
+
+char *bn_to_hex_arena(const bn *p, struct bn_arena *ar)
+{
+    char *s = bn_arena_alloc(ar, bn_to_hex_size(p));
+
+    if (s)
+        bn_to_hex_buf(p, s);
+    return s;
+}
+
+void bn_to_le(const bn *p, void *out, unsigned int n)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(out, p->num, sizeof(bn_data) * n);
+#else
+    unsigned char *b = out;
+    for (unsigned int i = 0; i < n; i++) {
+        for (unsigned int j = 0; j < sizeof(bn_data); j++)
+            *b++ = p->num[i] >> (8 * j);
+    }
+#endif
+}
+
+/* C = C + A for C, A >= 0, without a temporary */
+static int bn_add_into(bn *c, const bn *a)
+{
+    unsigned int n = max(c->size, a->size);
+
+    if (bn_resize(c, n + 1))
+        return -ENOMEM;
+    c->num[n] = bn_add_nm(c->num, c->num, n, a->num, a->size);
+    if (!c->num[n])
+        bn_resize(c, n);
+    return 0;
+}
+
+/* C = 2 * B - A in one pass, assume B >= A >= 0 and C aliases neither */
+static int bn_dbl_sub(bn *c, const bn *b, const bn *a)
+{
+    if (bn_resize(c, b->size + 1))
+        return -ENOMEM;
+
+    bn_data hi = 0, borrow = 0;
+    unsigned int i = 0;
+    for (; i < a->size; i++) {
+        bn_data x = b->num[i] << 1 | hi, y = a->num[i];
+        bn_data t = x - y;
+        bn_data bo = (x < y) | (t < borrow);
+        hi = b->num[i] >> (BN_BIT - 1);
+        c->num[i] = t - borrow;
+        borrow = bo;
+    }
+    for (; i < b->size; i++) {
+        bn_data x = b->num[i] << 1 | hi;
+        hi = b->num[i] >> (BN_BIT - 1);
+        c->num[i] = x - borrow;
+        borrow = x < borrow;
+    }
+    c->num[i] = hi - borrow;
+
+    unsigned int size = c->size;
+    while (size > 1 && !c->num[size - 1])
+        size--;
+    bn_resize(c, size);
+    c->sign = 0;
+    return 0;
+}
+
+/*
+ * Limbs that hold F(k + 1), which has about (k + 1) * log2(phi) bits,
+ * SIZE_MAX when that does not even fit the arithmetic
+ */
+static size_t bn_fib_limbs(long long k)
+{
+    if ((unsigned long long) k >= ULLONG_MAX / 6943)
+        return SIZE_MAX;
+    return min_t(unsigned long long, (k + 1) * 6943ULL / 10000 / BN_BIT + 2,
+                 SIZE_MAX);
+}
+
+int bn_fib(bn *p, long long k)
 {
     p->sign = 0;
     bn_resize(p, 1);
     if (k <= 2) {
         p->num[0] = !!k;
-        return;
+        return 0;
     }
 
     bn_t a, b;
-    bn_init(a);
-    bn_init(b);
+    bn_init_arena(a, p->arena);
+    bn_init_arena(b, p->arena);
     a->num[0] = 0;
     b->num[0] = 1;
 
+    /* with room for the last sum nothing below can fail */
+    size_t cap = bn_fib_limbs(k);
+    int ret = -ENOMEM;
+    if (cap > UINT_MAX || bn_reserve(p, cap) || bn_reserve(a, cap) ||
+        bn_reserve(b, cap))
+        goto out;
+
     for (long long i = 2; i < k; i++) {
-        bn_add(p, a, b);
-        bn_cpy(a, p);
-        swap(*a, *b);
+        bn_add_into(a, b);
+        bn_swap(a, b);
     }
-    bn_add(p, a, b);
+    ret = bn_add(p, a, b);
+out:
     bn_free(a);
     bn_free(b);
+    return ret;
 }
 
-void bn_fib_fdoubling(bn *p, long long k)
+/* F(k) for k <= BN_FIB_INLINE_MAX by fast doubling on two-limb integers */
+static u_bn_data_tmp bn_fib_inline(long long k)
+{
+    if (k <= 2)
+        return !!k;
+
+    u_bn_data_tmp a = 0;  // F(0)
+    u_bn_data_tmp b = 1;  // F(1)
+
+    /* only the last F(n + 1) may wrap around, and it is not used */
+    for (unsigned long long h = 1ULL << (63 - __builtin_clzll(k)); h; h >>= 1) {
+        u_bn_data_tmp c = a * (2 * b - a);
+        u_bn_data_tmp d = a * a + b * b;
+
+        if (h & k) {
+            a = d;
+            b = c + d;
+        } else {
+            a = c;
+            b = d;
+        }
+    }
+    return a;
+}
+
+/* P = U, never allocates since P has BN_INLINE limbs */
+static void bn_set_u(bn *p, u_bn_data_tmp u)
 {
     p->sign = 0;
-    bn_resize(p, 1);
-    if (k <= 2) {
-        p->num[0] = !!k;
-        return;
+    bn_resize(p, 1 + !!(u >> BN_BIT));
+    p->num[0] = u;
+    if (p->size > 1)
+        p->num[1] = u >> BN_BIT;
+}
+
+/* One product of a fast doubling step */
+struct bn_fib_job {
+    bn *r;
+    const bn *x, *y;
+    struct bn_ws ws;
+    int err;
+};
+
+static void bn_fib_job_run(void *arg)
+{
+    struct bn_fib_job *j = arg;
+    j->err = bn_mul_ws(j->r, j->x, j->y, &j->ws);
+}
+
+/* Hand the pair over to P, copying only when P lives in another arena */
+static int bn_fib_move(bn *p, bn *x)
+{
+    if (p->arena != x->arena)
+        return bn_cpy(p, x);
+    bn_swap(p, x);
+    return 0;
+}
+
+int bn_fib_pair(bn *a, bn *b, long long k, struct bn_arena *ar)
+{
+    a->sign = b->sign = 0;
+    if (k < BN_FIB_INLINE_MAX) {
+        bn_set_u(a, bn_fib_inline(k));
+        bn_set_u(b, bn_fib_inline(k + 1));
+        return 0;
     }
 
-    bn *a = p;
-    bn_t b, c, d;
-    bn_init(b);
-    bn_init(c);
-    bn_init(d);
-    a->num[0] = 0;
-    b->num[0] = 1;
+    /* size everything for the last step, so the loop never allocates */
+    struct bn_mul_param mp;
+    bn_mul_param_get(&mp);
+    size_t limbs = bn_fib_limbs(k);
+    if (limbs > UINT_MAX)
+        return -ENOMEM;
+    unsigned int cap = limbs;
+    unsigned int par = READ_ONCE(bn_par_threshold);
+    if (!READ_ONCE(bn_par_run) || !par || cap < par)
+        par = UINT_MAX;
+
+    /*
+     * The loop works on its own x = F(n), y = F(n + 1) and moves results
+     * between numbers with bn_swap(), so no step copies limbs. Parallel
+     * products must not share an arena.
+     */
+    if (par != UINT_MAX)
+        ar = NULL;
+    bn_t x, y, c, d, e, f;
+    bn_init_arena(x, ar);
+    bn_init_arena(y, ar);
+    bn_init_arena(c, ar);
+    bn_init_arena(d, ar);
+    bn_init_arena(e, ar);
+    bn_init_arena(f, ar);
+    y->num[0] = 1;
 
+    size_t itch = bn_mul_itch(cap, &mp);
+    struct bn_fib_job job[] = {
+        {.r = f, .x = c, .y = x, .ws = {NULL, 0, ar}},
+        {.r = d, .x = x, .y = x, .ws = {NULL, 0, ar}},
+        {.r = e, .x = y, .y = y, .ws = {NULL, 0, ar}},
+    };
+    void *arg[] = {&job[0], &job[1], &job[2]};
+    unsigned int jobs = par != UINT_MAX ? ARRAY_SIZE(job) : 1;
+    int ret = -ENOMEM;
+    if (bn_reserve(x, cap) || bn_reserve(y, cap) || bn_reserve(c, cap) ||
+        bn_reserve(d, cap) || bn_reserve(e, cap) ||
+        (par != UINT_MAX && bn_reserve(f, cap)))
+        goto out;
+    for (unsigned int i = 0; i < jobs; i++)
+        if (itch && !bn_ws_get(&job[i].ws, itch))
+            goto out;
+
+    /* A and B are only touched once the pair is complete */
     for (unsigned long long h = 1ULL << (63 - __builtin_clzll(k)); h; h >>= 1) {
-        bn_cpy(c, b);
-        bn_lshift(c, 1);
-        bn_sub(c, c, a);
-        bn_mult(c, c, a);
+        /* c * x goes to f, or over y once y^2 is done */
+        bn *t = f;
 
-        bn_mult(a, a, a);
-        bn_mult(b, b, b);
-        bn_cpy(d, a);
-        bn_add(d, d, b);
+        ret = bn_dbl_sub(c, y, x);
+        if (ret)
+            goto out;
+        if (x->size >= par) {
+            /* c * x, x^2 and y^2 only read x, y and c */
+            bn_par_run(bn_fib_job_run, arg, ARRAY_SIZE(arg));
+            ret = job[0].err ?: job[1].err ?: job[2].err;
+        } else {
+            t = y;
+            ret = bn_mul_ws(d, x, x, &job[0].ws) ?:
+                  bn_mul_ws(e, y, y, &job[0].ws) ?:
+                  bn_mul_ws(t, c, x, &job[0].ws);
+        }
+        if (!ret)
+            ret = bn_add_into(d, e);
+        if (ret)
+            goto out;
 
         if (h & k) {
-            bn_cpy(a, d);
-            bn_add(b, c, d);
+            /* x = d, y = t + d */
+            ret = bn_add_into(t, d);
+            if (ret)
+                goto out;
+            bn_swap(x, d);
+            if (t != y)
+                bn_swap(y, t);
         } else {
-            bn_cpy(a, c);
-            bn_cpy(b, d);
+            /* x = t, y = d */
+            bn_swap(x, t);
+            bn_swap(y, d);
         }
     }
-    bn_free(b);
+    ret = bn_fib_move(a, x) ?: bn_fib_move(b, y);
+
+out:
+    for (unsigned int i = 0; i < ARRAY_SIZE(job); i++)
+        bn_mem_free(ar, job[i].ws.p);
+    bn_free(x);
+    bn_free(y);
     bn_free(c);
     bn_free(d);
+    bn_free(e);
+    bn_free(f);
+    return ret;
+}
+
+int bn_fib_advance(bn *a, bn *b, long long d)
+{
+    /* F(k + 2) = F(k) + F(k + 1) goes into the limbs of F(k) */
+    for (; d > 0; d--) {
+        if (bn_add_into(a, b))
+            return -ENOMEM;
+        bn_swap(a, b);
+    }
+    return 0;
+}
+
+/* Past this many steps the addition formula beats plain additions */
+#define BN_FIB_ADVANCE_MAX 64
+
+int bn_fib_pair_from(bn *a,
+                     bn *b,
+                     const bn *f0,
+                     const bn *f1,
+                     long long n,
+                     struct bn_arena *ar)
+{
+    if (n <= BN_FIB_ADVANCE_MAX) {
+        if (bn_cpy(a, f0) || bn_cpy(b, f1))
+            return -ENOMEM;
+        return bn_fib_advance(a, b, n);
+    }
+
+    bn_t x, y, t;
+    bn_init_arena(x, ar);
+    bn_init_arena(y, ar);
+    bn_init_arena(t, ar);
+    struct bn_ws ws = {NULL, 0, ar};
+
+    /* F(c + n) = F(c) * F(n + 1) + F(c - 1) * F(n) */
+    int ret = bn_fib_pair(x, y, n, ar) ?: bn_sub(t, f1, f0) ?:
+              bn_mul_ws(a, t, x, &ws) ?: bn_mul_ws(t, f0, y, &ws) ?:
+              bn_add_into(a, t);
+
+    /* F(c + n + 1) = F(c + 1) * F(n + 1) + F(c) * F(n) */
+    if (!ret)
+        ret = bn_mul_ws(b, f1, y, &ws) ?: bn_mul_ws(t, f0, x, &ws) ?:
+              bn_add_into(b, t);
+
+    bn_mem_free(ws.arena, ws.p);
+    bn_free(x);
+    bn_free(y);
+    bn_free(t);
+    return ret;
+}
+
+size_t bn_fib_mem(long long k)
+{
+    struct bn_mul_param mp;
+    bn_mul_param_get(&mp);
+    size_t n = bn_fib_limbs(k);
+
+    /* every term below is a small multiple of n, keep them from wrapping */
+    if (n > min_t(size_t, UINT_MAX, SIZE_MAX / 256 / sizeof(bn_data)))
+        return SIZE_MAX;
+
+    /*
+     * bn_fib_pair(): six temporaries, a copy of the pair when it lives in
+     * another arena and the scratch of three products. bn_to_string(): a
+     * copy, the powers of ten with their reciprocals, the scratch of a
+     * Barrett step and fewer than BN_BIT / 3 digits per limb.
+     */
+    size_t limbs = 8 * n + 3 * bn_mul_itch(n, &mp);
+    limbs += 12 * n + 64 + bn_mul_itch(n + 2, &mp);
+    return limbs * sizeof(bn_data) + n * BN_BIT / 3 + 3;
+}
+
+int bn_fib_fdoubling(bn *p, long long k)
+{
+    if (k <= BN_FIB_INLINE_MAX) {
+        bn_set_u(p, bn_fib_inline(k));
+        return 0;
+    }
+
+    bn_t b;
+    bn_init_arena(b, p->arena);
+    int ret = bn_fib_pair(p, b, k, p->arena);
+    bn_free(b);
+    return ret;
 }
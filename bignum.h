@@ -24,31 +24,178 @@ static inline unsigned int clz(bn_data x)
 }
 
 
+/*
+ * Bump allocator for the bignums of one request. Nothing is freed until
+ * bn_arena_reset(), which also makes the block big enough for the largest
+ * request seen, so steady traffic never reaches the page allocator.
+ */
+struct bn_arena {
+    char *base;
+    size_t size;   /* bytes in base */
+    size_t used;   /* bytes of base handed out */
+    size_t demand; /* bytes asked for since the last reset */
+    void *spill;   /* allocations that did not fit in base */
+};
+
+void bn_arena_init(struct bn_arena *ar);
+void bn_arena_reset(struct bn_arena *ar);
+void bn_arena_destroy(struct bn_arena *ar);
+
+/* Memory that lives until the next bn_arena_reset() */
+void *bn_arena_alloc(struct bn_arena *ar, size_t size);
+
+
+/* Limbs stored in the bn itself, enough for 128 bits */
+#define BN_INLINE (128 / BN_BIT)
+
+/* Buffer size for bn_to_string_inline(): 39 digits, sign and NUL */
+#define BN_INLINE_STR 41
+
+/* Largest k such that F(k) fits in two limbs */
+#if BN_BIT == 64
+#define BN_FIB_INLINE_MAX 186
+#else
+#define BN_FIB_INLINE_MAX 93
+#endif
+
 typedef struct {
     bn_data *num;
-    unsigned int size;
+    struct bn_arena *arena; /* NULL if num is on the heap */
+    unsigned int size;      /* limbs in use */
+    unsigned int capacity;  /* limbs allocated */
     unsigned int sign : 1;
+    bn_data inl[BN_INLINE]; /* num points here while the number is small */
 } bn, bn_t[1];
 
 
 void bn_init(bn *p);
 
+/* Like bn_init(), but P and its temporaries live in arena */
+void bn_init_arena(bn *p, struct bn_arena *arena);
+
 void bn_free(bn *p);
 
+/* Make room for at least capacity limbs, return 0 or -ENOMEM */
+int bn_reserve(bn *p, unsigned int capacity);
+
+/* Number of limb buffer allocations made so far, and their bytes */
+long bn_alloc_count(void);
+long bn_alloc_bytes(void);
+
+/* Arithmetic returns 0, or -ENOMEM leaving the result as it was */
+
 /* C = A + B */
-void bn_add(bn *c, const bn *a, const bn *b);
+int bn_add(bn *c, const bn *a, const bn *b);
 
 /* C = A - B */
-void bn_sub(bn *c, const bn *a, const bn *b);
+int bn_sub(bn *c, const bn *a, const bn *b);
 
 /* C = A * B */
-void bn_mult(bn *c, const bn *a, const bn *b);
+int bn_mult(bn *c, const bn *a, const bn *b);
+
+/* C = A * A */
+int bn_sqr(bn *c, const bn *a);
+
+/*
+ * Operand sizes, in limbs of the shorter operand, from which bn_mult switches
+ * from schoolbook to Karatsuba and from Karatsuba to Toom-3
+ */
+extern unsigned int bn_karatsuba_threshold;
+extern unsigned int bn_toom3_threshold;
 
-void bn_lshift(bn *src, unsigned int shift);
+/*
+ * Limbs of the shorter operand from which bn_mult and bn_sqr use a three
+ * prime NTT, 0 disables it. Only with 64-bit limbs.
+ */
+extern unsigned int bn_ntt_threshold;
 
+/*
+ * Executor for independent jobs: run fn(arg[i]) for each i < n, n is at most
+ * BN_PAR_MAX, and return once all are done. Left NULL, nothing runs in
+ * parallel.
+ */
+#define BN_PAR_MAX 5
+typedef void (*bn_job_fn)(void *arg);
+extern void (*bn_par_run)(bn_job_fn fn, void **arg, unsigned int n);
+
+/*
+ * Limbs from which fast doubling runs its three products through bn_par_run,
+ * and from which a single product runs its Karatsuba or Toom-3 pieces
+ * through it, 0 disables either
+ */
+extern unsigned int bn_par_threshold;
+extern unsigned int bn_par_split_threshold;
+
+/*
+ * Switch the limb loops between the x86-64 assembly in bignum_x86.S and the
+ * portable C, which is the default. Fails with -EOPNOTSUPP when this build
+ * or CPU has no assembly for them.
+ */
+int bn_set_asm(bool on);
+bool bn_asm_enabled(void);
+
+int bn_lshift(bn *src, unsigned int shift);
+
+/* The string is allocated like P, release it with bn_free_string() */
 char *bn_to_string(const bn *p);
+void bn_free_string(const bn *p, char *s);
+
+/* Like bn_to_string(), with the string and all scratch taken from AR */
+char *bn_to_string_arena(const bn *p, struct bn_arena *ar);
+
+/*
+ * Like bn_to_string_arena(), but into buf of bn_to_string_size(P) bytes
+ * with only the scratch from AR. Return the string length, 0 when out of
+ * memory.
+ */
+size_t bn_to_string_size(const bn *p);
+size_t bn_to_string_buf(const bn *p, char *buf, struct bn_arena *ar);
+
+/* Lowercase hexadecimal, without prefix, allocated from AR */
+char *bn_to_hex_arena(const bn *p, struct bn_arena *ar);
+
+/* Like bn_to_hex_arena(), into buf of bn_to_hex_size(P) bytes */
+size_t bn_to_hex_size(const bn *p);
+size_t bn_to_hex_buf(const bn *p, char *buf);
+
+/* Store the low N limbs of |P| as little-endian bytes */
+void bn_to_le(const bn *p, void *out, unsigned int n);
+
+/*
+ * Write P, of at most BN_INLINE limbs, to a BN_INLINE_STR byte buffer
+ * without allocating, return the string length
+ */
+size_t bn_to_string_inline(const bn *p, char *buf);
+
+/*
+ * F(k) into P. The Fibonacci functions return 0, or -ENOMEM leaving their
+ * results unspecified.
+ */
+int bn_fib(bn *p, long long k);
+int bn_fib_fdoubling(bn *p, long long k);
+
+/* Rough upper bound of the bytes computing and rendering F(k) takes */
+size_t bn_fib_mem(long long k);
+
+/*
+ * (A, B) = (F(k), F(k + 1)) by fast doubling, with scratch from ar or the
+ * heap for NULL. A and B keep where their limbs live.
+ */
+int bn_fib_pair(bn *a, bn *b, long long k, struct bn_arena *ar);
+
+/* Step (A, B) = (F(k), F(k + 1)) to (F(k + d), F(k + d + 1)) by additions */
+int bn_fib_advance(bn *a, bn *b, long long d);
 
-void bn_fib(bn *p, long long k);
-void bn_fib_fdoubling(bn *p, long long k);
+/*
+ * (A, B) = (F(c + n), F(c + n + 1)) from F0 = F(c) and F1 = F(c + 1), by
+ * additions for small n and by the addition formula otherwise, scratch as
+ * for bn_fib_pair()
+ */
+int bn_fib_pair_from(bn *a,
+                     bn *b,
+                     const bn *f0,
+                     const bn *f1,
+                     long long n,
+                     struct bn_arena *ar);
 
 #endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "bignum.h"
+
+/*
+ * Time the bignum primitives in user space, built against shim/ instead of
+ * the kernel. Every measurement repeats the operation until it has run for
+ * at least MIN_NS and prints one CSV row per operation and size:
+ *
+ *   op,k,limbs,reps,ns,cycles
+ *
+ * where ns and cycles are per operation, k is the Fibonacci offset (0 for
+ * the limb sweep) and cycles come from the TSC where there is one.
+ *
+ * usage: bn_bench [max_limbs [k ...]]
+ *
+ * The assembly limb loops are used where there are some, unless BN_NO_ASM
+ * is set in the environment.
+ */
+#define MIN_NS 20000000ULL
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+static bn_data rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (bn_data) rnd_state;
+}
+
+/* Random n-limb number with the top limb nonzero */
+static void rand_bn(bn *p, unsigned int n)
+{
+    if (bn_reserve(p, n)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < n; i++)
+        p->num[i] = rnd();
+    p->num[n - 1] |= 1;
+    p->size = n;
+    p->sign = 0;
+}
+
+struct bench {
+    const char *op;
+    void (*run)(struct bench *t);
+    long long k;
+    unsigned int limbs;
+    bn *c;
+    const bn *a, *b;
+};
+
+static void run_add(struct bench *t)
+{
+    bn_add(t->c, t->a, t->b);
+}
+
+static void run_sub(struct bench *t)
+{
+    bn_sub(t->c, t->a, t->b);
+}
+
+static void run_mult(struct bench *t)
+{
+    bn_mult(t->c, t->a, t->b);
+}
+
+static void run_sqr(struct bench *t)
+{
+    bn_sqr(t->c, t->a);
+}
+
+static void run_fib(struct bench *t)
+{
+    bn_fib_fdoubling(t->c, t->k);
+}
+
+static void run_to_string(struct bench *t)
+{
+    char *s = bn_to_string(t->a);
+    bn_free_string(t->a, s);
+}
+
+static void measure(struct bench *t)
+{
+    unsigned long long reps = 1, ns, cycles;
+
+    for (;;) {
+        unsigned long long t0 = now_ns(), c0 = now_cycles();
+        for (unsigned long long i = 0; i < reps; i++)
+            t->run(t);
+        ns = now_ns() - t0;
+        cycles = now_cycles() - c0;
+        if (ns >= MIN_NS)
+            break;
+        reps *= 2;
+    }
+    printf("%s,%lld,%u,%llu,%llu,%llu\n", t->op, t->k, t->limbs, reps,
+           ns / reps, cycles / reps);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int max_limbs = argc > 1 ? atoi(argv[1]) : 4096;
+    static const long long default_k[] = {100, 1000, 10000, 100000, 1000000};
+    static const struct {
+        const char *op;
+        void (*run)(struct bench *t);
+    } limb_ops[] = {
+        {"add", run_add},
+        {"sub", run_sub},
+        {"mult", run_mult},
+        {"sqr", run_sqr},
+    };
+    bn_t a, b, c;
+
+    bn_set_asm(!getenv("BN_NO_ASM"));
+    bn_init(a);
+    bn_init(b);
+    bn_init(c);
+    printf("op,k,limbs,reps,ns,cycles\n");
+
+    for (unsigned int n = 1; n <= max_limbs; n *= 2) {
+        rand_bn(a, n);
+        rand_bn(b, n);
+        /* keep A > B so that bn_sub never goes negative */
+        a->num[n - 1] |= (bn_data) 1 << (BN_BIT - 1);
+        b->num[n - 1] &= ~((bn_data) 1 << (BN_BIT - 1));
+        for (unsigned int i = 0; i < ARRAY_SIZE(limb_ops); i++) {
+            struct bench t = {limb_ops[i].op, limb_ops[i].run, 0, n, c, a, b};
+            measure(&t);
+        }
+    }
+
+    int nk = argc > 2 ? argc - 2 : (int) ARRAY_SIZE(default_k);
+    for (int i = 0; i < nk; i++) {
+        long long k = argc > 2 ? atoll(argv[i + 2]) : default_k[i];
+
+        if (bn_fib_fdoubling(a, k)) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        struct bench fib = {"fib", run_fib, k, a->size, c, NULL, NULL};
+        struct bench str = {"to_string", run_to_string, k, a->size, NULL, a,
+                            NULL};
+        measure(&fib);
+        measure(&str);
+    }
+
+    bn_free(a);
+    bn_free(b);
+    bn_free(c);
+    return 0;
+}
@@ -0,0 +1,343 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bignum.h"
+
+/*
+ * Self-test of the bignum code, built in user space like bn_bench:
+ *
+ *  - every multiplication path, with thresholds lowered so that small
+ *    operands reach it, against schoolbook
+ *  - decimal conversion, naive and divide-and-conquer, against repeated
+ *    division, and within the size bn_to_string_size() promises
+ *  - F(k) for large k against known lengths and FNV-1a hashes of its
+ *    decimal and hexadecimal strings
+ *
+ * all with the assembly limb loops off and, where there are some, on.
+ * Prints what failed and exits nonzero on any mismatch.
+ */
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+static bn_data rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return (bn_data) rnd_state;
+}
+
+/* Values that stress carries more than random limbs do */
+enum fill { FILL_RANDOM, FILL_ONES, FILL_SPARSE };
+
+static void oom(void)
+{
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+}
+
+static void set_bn(bn *p, unsigned int n, enum fill fill, unsigned int sign)
+{
+    if (bn_reserve(p, n))
+        oom();
+    for (unsigned int i = 0; i < n; i++) {
+        switch (fill) {
+        case FILL_RANDOM:
+            p->num[i] = rnd();
+            break;
+        case FILL_ONES:
+            p->num[i] = ~(bn_data) 0;
+            break;
+        case FILL_SPARSE:
+            p->num[i] = rnd() % 4 ? 0 : rnd();
+            break;
+        }
+    }
+    p->num[n - 1] |= 1;
+    p->size = n;
+    p->sign = sign;
+}
+
+static void copy_bn(bn *p, const bn *a)
+{
+    if (bn_reserve(p, a->size))
+        oom();
+    memcpy(p->num, a->num, sizeof(bn_data) * a->size);
+    p->size = a->size;
+    p->sign = a->sign;
+}
+
+static int bn_equal(const bn *a, const bn *b)
+{
+    return a->size == b->size && a->sign == b->sign &&
+           !memcmp(a->num, b->num, sizeof(bn_data) * a->size);
+}
+
+/* Thresholds that steer bn_mult to one path or a mix of them */
+struct mul_cfg {
+    const char *name;
+    unsigned int karatsuba, toom3, ntt;
+    unsigned int par, split; /* 0 keeps everything on one thread */
+};
+
+static const struct mul_cfg schoolbook = {"schoolbook", UINT_MAX, UINT_MAX,
+                                          0,            0,        0};
+
+static const struct mul_cfg cfgs[] = {
+    {"karatsuba", 8, UINT_MAX, 0, 0, 0},
+    {"toom3", 8, 8, 0, 0, 0},
+    {"karatsuba+toom3", 8, 24, 0, 0, 0},
+    {"ntt", 8, 8, 8, 0, 0},
+    {"toom3+ntt", 8, 24, 96, 0, 0},
+    {"split", 8, 24, 96, 16, 16},
+};
+
+static unsigned int def_karatsuba, def_toom3, def_ntt, def_par, def_split;
+
+/* Jobs one after the other, enough to reach the split code paths */
+static void run_serial(bn_job_fn fn, void **arg, unsigned int n)
+{
+    for (unsigned int i = 0; i < n; i++)
+        fn(arg[i]);
+}
+
+/* C NULL for the defaults, with an executor like the module has */
+static void set_cfg(const struct mul_cfg *c)
+{
+    bn_karatsuba_threshold = c ? c->karatsuba : def_karatsuba;
+    bn_toom3_threshold = c ? c->toom3 : def_toom3;
+    bn_ntt_threshold = c ? c->ntt : def_ntt;
+    bn_par_threshold = c ? c->par : def_par;
+    bn_par_split_threshold = c ? c->split : def_split;
+    bn_par_run = !c || c->par || c->split ? run_serial : NULL;
+}
+
+static int failures;
+
+static void fail(const char *what, const char *cfg, unsigned int an,
+                 unsigned int bn)
+{
+    fprintf(stderr, "FAIL %s %s %u x %u limbs, asm %s\n", what, cfg, an, bn,
+            bn_asm_enabled() ? "on" : "off");
+    failures++;
+}
+
+/* C = A * B, A * A and A *= B in place, each against schoolbook */
+static void check_mul(const struct mul_cfg *c, const bn *a, const bn *b)
+{
+    bn_t ref, sq_ref, a2, r;
+    bn_init(ref);
+    bn_init(sq_ref);
+    bn_init(a2);
+    bn_init(r);
+
+    /* A * A2 with A2 a copy of A is a product, not a square */
+    set_cfg(&schoolbook);
+    copy_bn(a2, a);
+    if (bn_mult(ref, a, b) || bn_mult(sq_ref, a, a2))
+        oom();
+
+    set_cfg(c);
+    if (bn_mult(r, a, b))
+        oom();
+    if (!bn_equal(r, ref))
+        fail("mult", c->name, a->size, b->size);
+    if (bn_sqr(r, a))
+        oom();
+    if (!bn_equal(r, sq_ref))
+        fail("sqr", c->name, a->size, a->size);
+    if (bn_mult(a2, a2, b))
+        oom();
+    if (!bn_equal(a2, ref))
+        fail("mult in place", c->name, a->size, b->size);
+
+    bn_free(ref);
+    bn_free(sq_ref);
+    bn_free(a2);
+    bn_free(r);
+}
+
+static void check_muls(void)
+{
+    static const unsigned int sizes[] = {1,  2,  3,   7,   8,   9,   15,
+                                         16, 17, 31,  33,  63,  64,  65,
+                                         96, 97, 128, 191, 257, 400, 700};
+    bn_t a, b;
+    bn_init(a);
+    bn_init(b);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        unsigned int n = sizes[i];
+        /* balanced, the unbalanced splits and a single limb */
+        unsigned int m[] = {n, n - n / 4, n / 2 + 1, n / 3 + 1, 1};
+
+        for (unsigned int j = 0; j < ARRAY_SIZE(m); j++) {
+            enum fill fill = (i + j) % 3;
+
+            set_bn(a, n, fill, j & 1);
+            set_bn(b, m[j], fill, j == 2);
+            for (unsigned int k = 0; k < ARRAY_SIZE(cfgs); k++)
+                check_mul(&cfgs[k], a, b);
+        }
+    }
+    bn_free(a);
+    bn_free(b);
+}
+
+/* Decimal string of P by dividing a copy by 10^9 until nothing is left */
+static char *dec_naive(const bn *p)
+{
+    unsigned int n = p->size;
+    bn_data *t = malloc(sizeof(bn_data) * n);
+    size_t len = (size_t) BN_BIT * n / 3 + 12;
+    char *s = malloc(len + 2), *q = s + len + 1;
+
+    memcpy(t, p->num, sizeof(bn_data) * n);
+    *q = '\0';
+    do {
+        u_bn_data_tmp rem = 0;
+        for (unsigned int i = n; i--;) {
+            rem = rem << BN_BIT | t[i];
+            t[i] = rem / 1000000000;
+            rem %= 1000000000;
+        }
+        while (n > 1 && !t[n - 1])
+            n--;
+        for (int i = 0; i < 9; i++, rem /= 10)
+            *--q = '0' + rem % 10;
+    } while (n > 1 || t[0]);
+    while (q[0] == '0' && q[1])
+        q++;
+    if (p->sign)
+        *--q = '-';
+    memmove(s, q, strlen(q) + 1);
+    free(t);
+    return s;
+}
+
+static void check_dec(void)
+{
+    /* on both sides of the divide-and-conquer threshold and well above */
+    static const unsigned int sizes[] = {1,  2,  3,  40,  79,  80,
+                                         81, 97, 160, 333, 700, 1500};
+    bn_t a;
+    bn_init(a);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        for (unsigned int f = FILL_RANDOM; f <= FILL_SPARSE; f++) {
+            set_bn(a, sizes[i], f, i & 1);
+            char *ref = dec_naive(a);
+
+            for (unsigned int k = 0; k <= ARRAY_SIZE(cfgs); k++) {
+                const struct mul_cfg *c = k ? &cfgs[k - 1] : NULL;
+
+                set_cfg(c);
+                char *s = bn_to_string(a);
+                if (!s || strcmp(s, ref) ||
+                    strlen(s) >= bn_to_string_size(a))
+                    fail("to_string", c ? c->name : "default", sizes[i], 0);
+                bn_free_string(a, s);
+            }
+            free(ref);
+        }
+    }
+    set_cfg(NULL);
+    bn_free(a);
+}
+
+static unsigned long long fnv1a(const char *s)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Decimal and hexadecimal strings of F(k), from Python's integers */
+static const struct {
+    long long k;
+    size_t dec_len;
+    const char *dec_head;
+    unsigned long long dec_fnv;
+    size_t hex_len;
+    unsigned long long hex_fnv;
+    int all_cfgs; /* also under every mul_cfg, not only the defaults */
+} fibs[] = {
+    {100000, 20899, "25974069347221724166", 0x650c65e0f0ffeaefULL, 17356,
+     0x6782e54346959d6fULL, 1},
+    {131071, 27392, "74047466307177395422", 0xf627436516516f60ULL, 22749,
+     0xe80a5a75915971f8ULL, 1},
+    {1000000, 208988, "19532821287077577316", 0x05e8be02fffcd32fULL, 173561,
+     0xeb3b456f1b0d34e5ULL, 0},
+};
+
+static void check_fib_value(unsigned int i, const bn *f, const char *how)
+{
+    struct bn_arena ar;
+    bn_arena_init(&ar);
+    char *dec = bn_to_string_arena(f, &ar);
+    char *hex = bn_to_hex_arena(f, &ar);
+
+    if (!dec || !hex || strlen(dec) != fibs[i].dec_len ||
+        strncmp(dec, fibs[i].dec_head, strlen(fibs[i].dec_head)) ||
+        fnv1a(dec) != fibs[i].dec_fnv || strlen(hex) != fibs[i].hex_len ||
+        fnv1a(hex) != fibs[i].hex_fnv || strlen(dec) >= bn_to_string_size(f) ||
+        strlen(hex) >= bn_to_hex_size(f)) {
+        fprintf(stderr, "FAIL F(%lld) %s, asm %s\n", fibs[i].k, how,
+                bn_asm_enabled() ? "on" : "off");
+        failures++;
+    }
+    bn_arena_destroy(&ar);
+}
+
+static void check_fibs(void)
+{
+    bn_t f;
+    bn_init(f);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(fibs); i++) {
+        unsigned int n = fibs[i].all_cfgs ? ARRAY_SIZE(cfgs) : 0;
+
+        for (unsigned int k = 0; k <= n; k++) {
+            const struct mul_cfg *c = k ? &cfgs[k - 1] : NULL;
+
+            set_cfg(c);
+            if (bn_fib_fdoubling(f, fibs[i].k))
+                oom();
+            check_fib_value(i, f, c ? c->name : "default");
+        }
+        set_cfg(NULL);
+    }
+
+    /* plain additions, which share nothing with fast doubling */
+    if (bn_fib(f, fibs[0].k))
+        oom();
+    check_fib_value(0, f, "by additions");
+    bn_free(f);
+}
+
+int main(void)
+{
+    def_karatsuba = bn_karatsuba_threshold;
+    def_toom3 = bn_toom3_threshold;
+    def_ntt = bn_ntt_threshold;
+    def_par = bn_par_threshold;
+    def_split = bn_par_split_threshold;
+
+    for (int on = 0; on <= 1; on++) {
+        int before = failures;
+
+        if (bn_set_asm(on)) {
+            printf("asm on: not available, skipped\n");
+            continue;
+        }
+        check_muls();
+        check_dec();
+        check_fibs();
+        printf("asm %s: %s\n", on ? "on" : "off",
+               failures > before ? "FAIL" : "ok");
+    }
+    return !!failures;
+}
@@ -0,0 +1,116 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fibring.h"
+
+#define FIB_DEV "/dev/fibonacci"
+#define RING_ENTRIES 64
+#define RING_AREA (1 << 20)
+
+/* The oldest completion, or NULL when none comes within a second */
+static struct fib_cqe *wait_a_second(struct fibring *r)
+{
+    struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+    struct fib_cqe *c = fibring_peek(r);
+
+    if (!c && fibring_enter(r) == 0 && poll(&pfd, 1, 1000) > 0)
+        c = fibring_peek(r);
+    return c;
+}
+
+/*
+ * F(10000) has 2090 digits, so in a 4096 byte area the second one has to
+ * start over at the beginning, which must work once the first is released.
+ */
+static int check_wrap(int fd)
+{
+    struct fibring r;
+    char first[4096];
+    int len;
+
+    int rc = fibring_init(&r, fd, 4, 4096, 0);
+    if (rc) {
+        fprintf(stderr, "Failed to set up rings: %s\n", strerror(-rc));
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fibring_submit(&r, 10000, i);
+        struct fib_cqe *c = wait_a_second(&r);
+        if (!c || c->err) {
+            printf("wrap: F(10000) #%d %s\n", i,
+                   c ? strerror(-c->err) : "never completed");
+            return 1;
+        }
+        if (!i) {
+            len = c->len;
+            memcpy(first, fibring_result(&r, c), len);
+        } else if ((int) c->len != len ||
+                   memcmp(first, fibring_result(&r, c), len)) {
+            printf("wrap: F(10000) #1 differs from #0\n");
+            return 1;
+        }
+        fibring_seen(&r);
+    }
+    fibring_exit(&r);
+    printf("wrap: ok\n");
+    return 0;
+}
+
+/*
+ * Like client, but every offset goes through the shared rings. With "wrap"
+ * as the only argument, check that a result wrapping an empty area is
+ * served instead.
+ */
+int main(int argc, char *argv[])
+{
+    int wrap = argc > 1 && !strcmp(argv[1], "wrap");
+    int offset = argc > 1 ? atoi(argv[1]) : 1000;
+    unsigned int flags = argc > 2 && !strcmp(argv[2], "sqpoll")
+                             ? FIB_RING_SQPOLL
+                             : 0;
+    struct fibring r;
+
+    int fd = open(FIB_DEV, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open character device");
+        exit(1);
+    }
+    if (wrap)
+        return check_wrap(fd);
+    int rc = fibring_init(&r, fd, RING_ENTRIES, RING_AREA, flags);
+    if (rc) {
+        fprintf(stderr, "Failed to set up rings: %s\n", strerror(-rc));
+        exit(1);
+    }
+
+    int next = 0, done = 0;
+    while (done <= offset) {
+        while (next <= offset && !fibring_submit(&r, next, next))
+            next++;
+        fibring_enter(&r);
+
+        struct fib_cqe *c = fibring_wait(&r);
+        if (!c) {
+            perror("Failed to wait for completions");
+            exit(1);
+        }
+        for (; c; c = fibring_peek(&r), done++) {
+            if (c->err)
+                printf("Offset %lld failed: %s\n", (long long) c->k,
+                       strerror(-c->err));
+            else
+                printf("Reading from " FIB_DEV
+                       " at offset %lld, returned the sequence %.*s.\n",
+                       (long long) c->k, (int) c->len,
+                       fibring_result(&r, c));
+            fibring_seen(&r);
+        }
+    }
+
+    fibring_exit(&r);
+    close(fd);
+    return 0;
+}
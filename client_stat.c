@@ -1,61 +1,397 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
+#include "fibdrv.h"
 
 #define FIB_DEV "/dev/fibonacci"
-#define SAMPLE_SIZE 1000
 
-static inline double test(int fd, char write_buf[], int size)
+/*
+ * Benchmark runner over FIB_IOC_MEASURE. For every algorithm and offset it
+ * warms up, then samples until the 95% confidence interval of the median
+ * is within the requested precision or the sample limit is hit. Each
+ * sample has the wall-clock time user space saw for the ioctl and the
+ * time and cycles the driver measured around the call alone, their
+ * difference is the system call overhead.
+ *
+ * CSV columns, all times in ns:
+ *   algo,k,samples,
+ *   user_median,user_p90,user_p99,user_ci_lo,user_ci_hi,
+ *   kernel_median,kernel_p90,kernel_p99,kernel_ci_lo,kernel_ci_hi,
+ *   cycles_median,overhead_median
+ *
+ * With -c it compares two such CSV files instead and flags every point
+ * whose user median got slower by more than the threshold with confidence
+ * intervals that do not overlap, exiting 1 if there is any.
+ */
+
+static const char *const algo_names[] = {
+    [FIB_ALGO_SEQUENCE] = "sequence",
+    [FIB_ALGO_SEQUENCE2] = "sequence2",
+    [FIB_ALGO_FDOUBLING] = "fdoubling",
+    [FIB_ALGO_FDOUBLING_CLZ] = "fdoubling_clz",
+    [FIB_ALGO_BN_FIB] = "bn_fib",
+    [FIB_ALGO_BN_FDOUBLING] = "bn_fdoubling",
+    [FIB_ALGO_BN_TO_STRING] = "bn_to_string",
+};
+
+#define NR_ALGOS (sizeof(algo_names) / sizeof(*algo_names))
+
+struct options {
+    unsigned int algos; /* bit per enum fib_algo */
+    long long start, end, step;
+    int warmup;
+    int min_samples, max_samples;
+    double precision; /* CI half-width relative to the median */
+    int json;
+};
+
+struct summary {
+    double median, p90, p99, ci_lo, ci_hi;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Percentiles of n samples, sorted in place */
+static struct summary summarize(double *v, int n)
+{
+    struct summary s;
+
+    qsort(v, n, sizeof(*v), cmp_double);
+    s.median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+    s.p90 = v[(int) (0.90 * (n - 1))];
+    s.p99 = v[(int) (0.99 * (n - 1))];
+
+    /* distribution-free interval of the median, from order statistics */
+    double half = 1.96 * sqrt(n) / 2;
+    int lo = (int) floor(n / 2.0 - half), hi = (int) ceil(n / 2.0 + half);
+    s.ci_lo = v[lo < 0 ? 0 : lo];
+    s.ci_hi = v[hi > n - 1 ? n - 1 : hi];
+    return s;
+}
+
+static int measure(int fd, int algo, long long k, struct fib_measure *m)
 {
-    double t[SAMPLE_SIZE] = {};
-    double mean = 0.0, std = 0.0, result = 0.0;
-    int count = 0;
+    memset(m, 0, sizeof(*m));
+    m->k = k;
+    m->algo = algo;
+    return ioctl(fd, FIB_IOC_MEASURE, m);
+}
+
+/* Sample one point, return -1 when the driver refuses it */
+static int run_point(int fd,
+                     const struct options *o,
+                     int algo,
+                     long long k,
+                     FILE *out,
+                     int *first)
+{
+    double *user = malloc(sizeof(double) * o->max_samples);
+    double *kern = malloc(sizeof(double) * o->max_samples);
+    double *cyc = malloc(sizeof(double) * o->max_samples);
+    double *over = malloc(sizeof(double) * o->max_samples);
+    double *tmp = malloc(sizeof(double) * o->max_samples);
+    struct fib_measure m;
+    int n = 0, ret = -1;
 
-    for (int j = 0; j < SAMPLE_SIZE; j++) {
-        t[j] = (double) write(fd, write_buf, size);
-        mean += t[j];
+    if (!user || !kern || !cyc || !over || !tmp) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
-    mean /= SAMPLE_SIZE;
 
-    for (int j = 0; j < SAMPLE_SIZE; j++)
-        std += (t[j] - mean) * (t[j] - mean);
+    for (int i = 0; i < o->warmup; i++) {
+        if (measure(fd, algo, k, &m) < 0)
+            goto out;
+    }
 
-    std = sqrt(std / (SAMPLE_SIZE - 1));
+    while (n < o->max_samples) {
+        double t0 = now_ns();
+        if (measure(fd, algo, k, &m) < 0)
+            goto out;
+        user[n] = now_ns() - t0;
+        kern[n] = m.ns;
+        cyc[n] = m.cycles;
+        over[n] = user[n] - kern[n];
+        n++;
 
-    for (int j = 0; j < SAMPLE_SIZE; j++) {
-        if (t[j] >= mean - 2 * std && t[j] <= mean + 2 * std) {
-            result += t[j];
-            count++;
+        /* checking sorts a copy, so only do it every few samples */
+        if (n >= o->min_samples && n % 16 == 0) {
+            memcpy(tmp, user, sizeof(double) * n);
+            struct summary s = summarize(tmp, n);
+            if ((s.ci_hi - s.ci_lo) / 2 <= o->precision * s.median)
+                break;
         }
     }
-    result /= count;
-    return result;
+
+    struct summary u = summarize(user, n), kn = summarize(kern, n);
+    struct summary c = summarize(cyc, n), ov = summarize(over, n);
+
+    if (o->json) {
+        fprintf(out,
+                "%s\n  {\"algo\": \"%s\", \"k\": %lld, \"samples\": %d,\n"
+                "   \"user\": {\"median\": %.0f, \"p90\": %.0f, \"p99\": "
+                "%.0f, \"ci\": [%.0f, %.0f]},\n"
+                "   \"kernel\": {\"median\": %.0f, \"p90\": %.0f, \"p99\": "
+                "%.0f, \"ci\": [%.0f, %.0f]},\n"
+                "   \"cycles_median\": %.0f, \"overhead_median\": %.0f}",
+                *first ? "" : ",", algo_names[algo], k, n, u.median, u.p90,
+                u.p99, u.ci_lo, u.ci_hi, kn.median, kn.p90, kn.p99, kn.ci_lo,
+                kn.ci_hi, c.median, ov.median);
+    } else {
+        fprintf(out,
+                "%s,%lld,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,"
+                "%.0f,%.0f,%.0f\n",
+                algo_names[algo], k, n, u.median, u.p90, u.p99, u.ci_lo,
+                u.ci_hi, kn.median, kn.p90, kn.p99, kn.ci_lo, kn.ci_hi,
+                c.median, ov.median);
+    }
+    fflush(out);
+    *first = 0;
+    ret = 0;
+out:
+    free(user);
+    free(kern);
+    free(cyc);
+    free(over);
+    free(tmp);
+    return ret;
 }
 
-int main()
+static int run(const struct options *o)
 {
-    char write_buf[] = "testing writing";
-    int offset = 100; /* TODO: try test something bigger than the limit */
-
     int fd = open(FIB_DEV, O_RDWR);
     if (fd < 0) {
         perror("Failed to open character device");
-        exit(1);
+        return 1;
     }
 
-    for (int i = 0; i <= offset; i++) {
-        lseek(fd, i, SEEK_SET);
-        double naive_dynamic = test(fd, write_buf, 0);
-        double naive_static = test(fd, write_buf, 1);
-        double fdoubling = test(fd, write_buf, 2);
-        double fdoubling_clz = test(fd, write_buf, 3);
-        printf("%d %.5lf %.5lf %.5lf %.5lf\n", i, naive_dynamic, naive_static,
-               fdoubling, fdoubling_clz);
+    int first = 1;
+    if (o->json)
+        printf("[");
+    else
+        printf("algo,k,samples,user_median,user_p90,user_p99,user_ci_lo,"
+               "user_ci_hi,kernel_median,kernel_p90,kernel_p99,kernel_ci_lo,"
+               "kernel_ci_hi,cycles_median,overhead_median\n");
+
+    for (unsigned int a = 0; a < NR_ALGOS; a++) {
+        if (!(o->algos & (1U << a)))
+            continue;
+        for (long long k = o->start; k <= o->end; k += o->step) {
+            if (run_point(fd, o, a, k, stdout, &first) < 0) {
+                /* ERANGE past F(92), or FIB_MEASURE_BN_FIB_MAX for bn_fib */
+                fprintf(stderr, "%s k=%lld: %s\n", algo_names[a], k,
+                        strerror(errno));
+                break;
+            }
+        }
     }
 
+    if (o->json)
+        printf("\n]\n");
     close(fd);
     return 0;
 }
+
+/* Points of a CSV file from run(), keyed by algo and k */
+struct point {
+    char algo[32];
+    long long k;
+    double median, ci_lo, ci_hi;
+};
+
+static struct point *load_csv(const char *path, int *n)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    struct point *p = NULL;
+    int cap = 0;
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    *n = 0;
+    /* skip the header */
+    if (!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct point q;
+        double v[12];
+        int samples;
+
+        if (sscanf(line,
+                   "%31[^,],%lld,%d,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,"
+                   "%lf,%lf,%lf",
+                   q.algo, &q.k, &samples, &v[0], &v[1], &v[2], &v[3],
+                   &v[4], &v[5], &v[6], &v[7], &v[8], &v[9], &v[10],
+                   &v[11]) != 15)
+            continue;
+        q.median = v[0];
+        q.ci_lo = v[3];
+        q.ci_hi = v[4];
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            p = realloc(p, sizeof(*p) * cap);
+            if (!p) {
+                fprintf(stderr, "out of memory\n");
+                exit(2);
+            }
+        }
+        p[(*n)++] = q;
+    }
+    fclose(f);
+    return p;
+}
+
+static int compare(const char *base_path, const char *new_path, double thr)
+{
+    int nb, nn, regressions = 0;
+    struct point *base = load_csv(base_path, &nb);
+    struct point *cur = load_csv(new_path, &nn);
+
+    printf("algo,k,base_median,new_median,change_pct,verdict\n");
+    for (int i = 0; i < nn; i++) {
+        struct point *b = NULL;
+        for (int j = 0; j < nb && !b; j++) {
+            if (base[j].k == cur[i].k && !strcmp(base[j].algo, cur[i].algo))
+                b = &base[j];
+        }
+        if (!b)
+            continue;
+
+        double change = (cur[i].median - b->median) / b->median * 100;
+        const char *verdict = "same";
+        if (change > thr * 100 && cur[i].ci_lo > b->ci_hi) {
+            verdict = "SLOWER";
+            regressions++;
+        } else if (change < -thr * 100 && cur[i].ci_hi < b->ci_lo) {
+            verdict = "faster";
+        }
+        printf("%s,%lld,%.0f,%.0f,%+.1f,%s\n", cur[i].algo, cur[i].k,
+               b->median, cur[i].median, change, verdict);
+    }
+
+    fprintf(stderr, "%d regression(s)\n", regressions);
+    free(base);
+    free(cur);
+    return regressions ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-a algo,...] [-s start] [-e end] [-i step] "
+            "[-w warmup]\n"
+            "          [-n min_samples] [-N max_samples] [-p precision] "
+            "[-j]\n"
+            "       %s -c base.csv new.csv [-t threshold]\n"
+            "algos:",
+            prog, prog);
+    for (unsigned int a = 0; a < NR_ALGOS; a++)
+        fprintf(stderr, " %s", algo_names[a]);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+static unsigned int parse_algos(char *list, const char *prog)
+{
+    unsigned int mask = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        unsigned int a;
+        for (a = 0; a < NR_ALGOS; a++) {
+            if (!strcmp(tok, algo_names[a]))
+                break;
+        }
+        if (a == NR_ALGOS)
+            usage(prog);
+        mask |= 1U << a;
+    }
+    return mask;
+}
+
+int main(int argc, char *argv[])
+{
+    struct options o = {
+        .algos = (1U << FIB_ALGO_SEQUENCE) | (1U << FIB_ALGO_SEQUENCE2) |
+                 (1U << FIB_ALGO_FDOUBLING) | (1U << FIB_ALGO_FDOUBLING_CLZ),
+        .start = 0,
+        .end = 92,
+        .step = 1,
+        .warmup = 100,
+        .min_samples = 64,
+        .max_samples = 10000,
+        .precision = 0.01,
+    };
+    double threshold = 0.05;
+    int cmp = 0, opt;
+
+    while ((opt = getopt(argc, argv, "a:s:e:i:w:n:N:p:jct:")) != -1) {
+        switch (opt) {
+        case 'a':
+            o.algos = parse_algos(optarg, argv[0]);
+            break;
+        case 's':
+            o.start = atoll(optarg);
+            break;
+        case 'e':
+            o.end = atoll(optarg);
+            break;
+        case 'i':
+            o.step = atoll(optarg);
+            break;
+        case 'w':
+            o.warmup = atoi(optarg);
+            break;
+        case 'n':
+            o.min_samples = atoi(optarg);
+            break;
+        case 'N':
+            o.max_samples = atoi(optarg);
+            break;
+        case 'p':
+            o.precision = atof(optarg);
+            break;
+        case 'j':
+            o.json = 1;
+            break;
+        case 'c':
+            cmp = 1;
+            break;
+        case 't':
+            threshold = atof(optarg) / 100;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cmp) {
+        if (argc - optind != 2)
+            usage(argv[0]);
+        return compare(argv[optind], argv[optind + 1], threshold);
+    }
+    if (o.step <= 0 || o.min_samples < 1 || o.max_samples < o.min_samples)
+        usage(argv[0]);
+    return run(&o);
+}
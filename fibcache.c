@@ -0,0 +1,261 @@
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/hashtable.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include "fibcache.h"
+
+/*
+ * Lookups walk the hash under RCU and only pin the entry they find, so
+ * concurrent hits never take a lock. Inserts and evictions serialize on
+ * fib_cache_lock. Eviction is CLOCK: the list head is the hand, an entry
+ * hit since the hand last passed it is moved to the tail instead of being
+ * dropped.
+ */
+#define FIB_CACHE_BITS 10
+
+static DEFINE_HASHTABLE(fib_cache_tbl, FIB_CACHE_BITS);
+static LIST_HEAD(fib_cache_clock);
+static DEFINE_SPINLOCK(fib_cache_lock);
+
+static size_t fib_cache_bytes;         /* under fib_cache_lock */
+static unsigned int fib_cache_entries; /* under fib_cache_lock */
+static size_t fib_cache_max_bytes = 4 << 20;
+static unsigned int fib_cache_max_entries = 4096;
+
+/* Per CPU, so that lookups on the RCU path share no written line */
+struct fib_cache_stat {
+    long hits;
+    long misses;
+};
+static DEFINE_PER_CPU(struct fib_cache_stat, fib_cache_stat);
+static atomic_long_t fib_cache_evictions = ATOMIC_LONG_INIT(0);
+
+static size_t fib_cache_entry_size(size_t len)
+{
+    struct fib_cache_entry *e;
+    return struct_size(e, str, len + 1);
+}
+
+struct fib_cache_entry *fib_cache_get(long long k)
+{
+    struct fib_cache_entry *e;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(fib_cache_tbl, e, node, k)
+    {
+        if (e->k == k && refcount_inc_not_zero(&e->ref)) {
+            /* avoid dirtying the line when the bit is already set */
+            if (!READ_ONCE(e->referenced))
+                WRITE_ONCE(e->referenced, true);
+            rcu_read_unlock();
+            this_cpu_inc(fib_cache_stat.hits);
+            return e;
+        }
+    }
+    rcu_read_unlock();
+    this_cpu_inc(fib_cache_stat.misses);
+    return NULL;
+}
+
+void fib_cache_put(struct fib_cache_entry *e)
+{
+    if (refcount_dec_and_test(&e->ref))
+        kvfree_rcu(e, rcu);
+}
+
+/* Unlink e and drop the reference of the cache, lock held */
+static void fib_cache_remove(struct fib_cache_entry *e)
+{
+    hash_del_rcu(&e->node);
+    list_del(&e->clock);
+    fib_cache_bytes -= fib_cache_entry_size(e->len);
+    fib_cache_entries--;
+    fib_cache_put(e);
+}
+
+/* Evict until the cache is within its limits, lock held */
+static void fib_cache_shrink(void)
+{
+    /* each entry gets at most one second chance per call */
+    unsigned int spared = 0;
+
+    while (fib_cache_bytes > fib_cache_max_bytes ||
+           fib_cache_entries > fib_cache_max_entries) {
+        struct fib_cache_entry *e = list_first_entry(
+            &fib_cache_clock, struct fib_cache_entry, clock);
+
+        if (READ_ONCE(e->referenced) && spared++ < fib_cache_entries) {
+            WRITE_ONCE(e->referenced, false);
+            list_move_tail(&e->clock, &fib_cache_clock);
+            continue;
+        }
+        fib_cache_remove(e);
+        atomic_long_inc(&fib_cache_evictions);
+    }
+}
+
+void fib_cache_insert(long long k, const char *str, size_t len)
+{
+    size_t size = fib_cache_entry_size(len);
+    struct fib_cache_entry *e, *old;
+
+    if (size > READ_ONCE(fib_cache_max_bytes) ||
+        !READ_ONCE(fib_cache_max_entries))
+        return;
+
+    e = kvmalloc(size, GFP_KERNEL);
+    if (!e)
+        return;
+    refcount_set(&e->ref, 1);
+    e->referenced = false;
+    e->k = k;
+    e->len = len;
+    memcpy(e->str, str, len + 1);
+
+    spin_lock(&fib_cache_lock);
+    hash_for_each_possible(fib_cache_tbl, old, node, k)
+    {
+        /* another reader rendered it first */
+        if (old->k == k) {
+            spin_unlock(&fib_cache_lock);
+            kvfree(e);
+            return;
+        }
+    }
+    hash_add_rcu(fib_cache_tbl, &e->node, k);
+    list_add_tail(&e->clock, &fib_cache_clock);
+    fib_cache_bytes += size;
+    fib_cache_entries++;
+    fib_cache_shrink();
+    spin_unlock(&fib_cache_lock);
+}
+
+void fib_cache_exit(void)
+{
+    struct fib_cache_entry *e, *tmp;
+
+    spin_lock(&fib_cache_lock);
+    list_for_each_entry_safe (e, tmp, &fib_cache_clock, clock)
+        fib_cache_remove(e);
+    spin_unlock(&fib_cache_lock);
+}
+
+static ssize_t hits_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        sum += per_cpu(fib_cache_stat.hits, cpu);
+    return sysfs_emit(buf, "%ld\n", sum);
+}
+static DEVICE_ATTR_RO(hits);
+
+static ssize_t misses_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        sum += per_cpu(fib_cache_stat.misses, cpu);
+    return sysfs_emit(buf, "%ld\n", sum);
+}
+static DEVICE_ATTR_RO(misses);
+
+static ssize_t evictions_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&fib_cache_evictions));
+}
+static DEVICE_ATTR_RO(evictions);
+
+static ssize_t bytes_show(struct device *dev,
+                          struct device_attribute *attr,
+                          char *buf)
+{
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(fib_cache_bytes));
+}
+static DEVICE_ATTR_RO(bytes);
+
+static ssize_t entries_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(fib_cache_entries));
+}
+static DEVICE_ATTR_RO(entries);
+
+static ssize_t max_bytes_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(fib_cache_max_bytes));
+}
+
+static ssize_t max_bytes_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf,
+                               size_t count)
+{
+    unsigned long val;
+    int rc = kstrtoul(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    spin_lock(&fib_cache_lock);
+    WRITE_ONCE(fib_cache_max_bytes, val);
+    fib_cache_shrink();
+    spin_unlock(&fib_cache_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+static ssize_t max_entries_show(struct device *dev,
+                                struct device_attribute *attr,
+                                char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(fib_cache_max_entries));
+}
+
+static ssize_t max_entries_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf,
+                                 size_t count)
+{
+    unsigned int val;
+    int rc = kstrtouint(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    spin_lock(&fib_cache_lock);
+    WRITE_ONCE(fib_cache_max_entries, val);
+    fib_cache_shrink();
+    spin_unlock(&fib_cache_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(max_entries);
+
+static struct attribute *fib_cache_attrs[] = {
+    &dev_attr_hits.attr,      &dev_attr_misses.attr,
+    &dev_attr_evictions.attr, &dev_attr_bytes.attr,
+    &dev_attr_entries.attr,   &dev_attr_max_bytes.attr,
+    &dev_attr_max_entries.attr,
+    NULL,
+};
+
+const struct attribute_group fib_cache_group = {
+    .name = "cache",
+    .attrs = fib_cache_attrs,
+};
@@ -0,0 +1,34 @@
+#ifndef _FIBCACHE_H_
+#define _FIBCACHE_H_
+
+#include <linux/refcount.h>
+#include <linux/types.h>
+
+struct attribute_group;
+
+/* A rendered F(k), shared by every reader that holds a reference */
+struct fib_cache_entry {
+    struct hlist_node node;  /* hash bucket, walked under RCU */
+    struct list_head clock;  /* eviction order, under the cache lock */
+    struct rcu_head rcu;
+    refcount_t ref;          /* one for the cache, one per reader */
+    bool referenced;         /* hit since the clock hand last passed */
+    long long k;
+    size_t len;              /* strlen(str) */
+    char str[];
+};
+
+/* Drop every entry, for module exit */
+void fib_cache_exit(void);
+
+/* Return a referenced entry for k, or NULL on a miss */
+struct fib_cache_entry *fib_cache_get(long long k);
+void fib_cache_put(struct fib_cache_entry *e);
+
+/* Copy the string of len bytes into the cache as F(k) */
+void fib_cache_insert(long long k, const char *str, size_t len);
+
+/* sysfs statistics and limits, for the fibonacci device */
+extern const struct attribute_group fib_cache_group;
+
+#endif
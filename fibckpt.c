@@ -0,0 +1,376 @@
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include "fibckpt.h"
+
+/*
+ * Table of (F(c), F(c + 1)) for c = spacing, 2 * spacing, ... shared by every
+ * open. Readers pin the current table with a reference taken under RCU, a
+ * rebuild publishes a new table and the old one goes away with its last
+ * reader.
+ */
+struct fib_ckpt {
+    bn_t f0, f1;
+};
+
+struct fib_ckpt_table {
+    struct kref ref;
+    struct rcu_head rcu;
+    long long spacing;
+    unsigned int n;
+    size_t bytes; /* table and limbs */
+    struct fib_ckpt ent[];
+};
+
+static struct fib_ckpt_table __rcu *fib_ckpt;
+static DEFINE_MUTEX(fib_ckpt_mutex); /* serializes rebuilds */
+static bool fib_ckpt_live;           /* between init and exit, under mutex */
+
+static long long fib_ckpt_max_k;
+static long long fib_ckpt_spacing = 1024;
+static size_t fib_ckpt_max_bytes = 1 << 20;
+
+/* Requests served from a checkpoint and from scratch, and their time */
+static atomic64_t fib_ckpt_hits = ATOMIC64_INIT(0);
+static atomic64_t fib_ckpt_hit_ns = ATOMIC64_INIT(0);
+static atomic64_t fib_ckpt_misses = ATOMIC64_INIT(0);
+static atomic64_t fib_ckpt_miss_ns = ATOMIC64_INIT(0);
+
+static void fib_ckpt_free_rcu(struct rcu_head *rcu)
+{
+    struct fib_ckpt_table *t = container_of(rcu, struct fib_ckpt_table, rcu);
+
+    for (unsigned int i = 0; i < t->n; i++) {
+        bn_free(t->ent[i].f0);
+        bn_free(t->ent[i].f1);
+    }
+    kvfree(t);
+}
+
+static void fib_ckpt_release(struct kref *ref)
+{
+    struct fib_ckpt_table *t = container_of(ref, struct fib_ckpt_table, ref);
+    call_rcu(&t->rcu, fib_ckpt_free_rcu);
+}
+
+static struct fib_ckpt_table *fib_ckpt_get(void)
+{
+    struct fib_ckpt_table *t;
+
+    rcu_read_lock();
+    t = rcu_dereference(fib_ckpt);
+    if (t && !kref_get_unless_zero(&t->ref))
+        t = NULL;
+    rcu_read_unlock();
+    return t;
+}
+
+static void fib_ckpt_put(struct fib_ckpt_table *t)
+{
+    kref_put(&t->ref, fib_ckpt_release);
+}
+
+/* Entries a table starts with, it doubles from there as checkpoints come */
+#define FIB_CKPT_MIN 16U
+
+/*
+ * Move T to room for n >= t->n entries. Small checkpoints keep their limbs
+ * inline, those have to follow the entry.
+ */
+static struct fib_ckpt_table *fib_ckpt_resize(struct fib_ckpt_table *t,
+                                              unsigned int n)
+{
+    struct fib_ckpt_table *nt = kvmalloc(struct_size(t, ent, n), GFP_KERNEL);
+    if (!nt)
+        return NULL;
+
+    memcpy(nt, t, struct_size(t, ent, t->n));
+    for (unsigned int i = 0; i < t->n; i++) {
+        if (t->ent[i].f0->num == t->ent[i].f0->inl)
+            nt->ent[i].f0->num = nt->ent[i].f0->inl;
+        if (t->ent[i].f1->num == t->ent[i].f1->inl)
+            nt->ent[i].f1->num = nt->ent[i].f1->inl;
+    }
+    kvfree(t);
+    return nt;
+}
+
+/*
+ * Each checkpoint is reached from the previous one, stop at the budget. The
+ * entries are grown along, so a table that ends early does not pay for the
+ * ones it never got to.
+ */
+static struct fib_ckpt_table *fib_ckpt_build(long long spacing,
+                                             size_t max_bytes,
+                                             long long max_k)
+{
+    struct fib_ckpt_table *t;
+    unsigned int n, room;
+    size_t limb_bytes = 0;
+
+    if (spacing <= 0 || max_k < spacing)
+        return NULL;
+    n = min_t(long long, max_k / spacing, UINT_MAX);
+    room = min(n, FIB_CKPT_MIN);
+    t = kvmalloc(struct_size(t, ent, room), GFP_KERNEL);
+    if (!t)
+        return NULL;
+    kref_init(&t->ref);
+    t->spacing = spacing;
+    t->n = 0;
+
+    bn_t f0, f1;
+    bn_init(f0);
+    bn_init(f1);
+    bn_fib_pair(f0, f1, 0, NULL); /* inline limbs, cannot fail */
+
+    while (t->n < n) {
+        if (t->n == room) {
+            struct fib_ckpt_table *nt;
+
+            room = min_t(u64, 2ULL * room, n);
+            nt = fib_ckpt_resize(t, room);
+            if (!nt)
+                break;
+            t = nt;
+        }
+
+        struct fib_ckpt *e = &t->ent[t->n];
+        const bn *p0 = t->n ? t->ent[t->n - 1].f0 : f0;
+        const bn *p1 = t->n ? t->ent[t->n - 1].f1 : f1;
+
+        bn_init(e->f0);
+        bn_init(e->f1);
+        int err = bn_fib_pair_from(e->f0, e->f1, p0, p1, spacing, NULL);
+
+        /* a short table is still a valid one */
+        size_t limbs = (size_t) e->f0->capacity + e->f1->capacity;
+        size_t bytes = limb_bytes + limbs * sizeof(bn_data);
+        if (err || struct_size(t, ent, t->n + 1) + bytes > max_bytes) {
+            bn_free(e->f0);
+            bn_free(e->f1);
+            break;
+        }
+        limb_bytes = bytes;
+        t->n++;
+        cond_resched();
+    }
+    bn_free(f0);
+    bn_free(f1);
+
+    /* give back the entries past the last checkpoint */
+    if (t->n < room) {
+        struct fib_ckpt_table *nt = fib_ckpt_resize(t, t->n);
+        if (nt)
+            t = nt;
+    }
+    t->bytes = struct_size(t, ent, t->n) + limb_bytes;
+    return t;
+}
+
+/* Replace the table with one for the current limits, once init has run */
+static void fib_ckpt_rebuild(void)
+{
+    struct fib_ckpt_table *t, *old;
+
+    mutex_lock(&fib_ckpt_mutex);
+    if (!fib_ckpt_live) {
+        mutex_unlock(&fib_ckpt_mutex);
+        return;
+    }
+    t = fib_ckpt_build(fib_ckpt_spacing, fib_ckpt_max_bytes,
+                       READ_ONCE(fib_ckpt_max_k));
+    old = rcu_replace_pointer(fib_ckpt, t, lockdep_is_held(&fib_ckpt_mutex));
+    mutex_unlock(&fib_ckpt_mutex);
+    if (old)
+        fib_ckpt_put(old);
+}
+
+void fib_ckpt_init(long long max_k)
+{
+    WRITE_ONCE(fib_ckpt_max_k, max_k);
+    mutex_lock(&fib_ckpt_mutex);
+    fib_ckpt_live = true;
+    mutex_unlock(&fib_ckpt_mutex);
+    fib_ckpt_rebuild();
+}
+
+void fib_ckpt_set_max(long long max_k)
+{
+    WRITE_ONCE(fib_ckpt_max_k, max_k);
+    fib_ckpt_rebuild();
+}
+
+void fib_ckpt_exit(void)
+{
+    struct fib_ckpt_table *old;
+
+    mutex_lock(&fib_ckpt_mutex);
+    fib_ckpt_live = false;
+    old = rcu_replace_pointer(fib_ckpt, NULL, lockdep_is_held(&fib_ckpt_mutex));
+    mutex_unlock(&fib_ckpt_mutex);
+    if (old)
+        fib_ckpt_put(old);
+    /* fib_ckpt_free_rcu must not run after the module is gone */
+    rcu_barrier();
+}
+
+int fib_ckpt_pair(bn *a, bn *b, long long k, struct bn_arena *ar)
+{
+    struct fib_ckpt_table *t = fib_ckpt_get();
+    u64 start = ktime_get_ns();
+    int ret;
+
+    if (t) {
+        long long i = min_t(long long, k / t->spacing, t->n);
+        long long c = i * t->spacing;
+
+        /*
+         * The addition formula only pays off while k - c is well below c,
+         * past that fast doubling from scratch is as cheap
+         */
+        if (i && (k - c) * 4 <= c) {
+            ret = bn_fib_pair_from(a, b, t->ent[i - 1].f0, t->ent[i - 1].f1,
+                                   k - c, ar);
+            fib_ckpt_put(t);
+            atomic64_inc(&fib_ckpt_hits);
+            atomic64_add(ktime_get_ns() - start, &fib_ckpt_hit_ns);
+            return ret;
+        }
+        fib_ckpt_put(t);
+    }
+
+    ret = bn_fib_pair(a, b, k, ar);
+    atomic64_inc(&fib_ckpt_misses);
+    atomic64_add(ktime_get_ns() - start, &fib_ckpt_miss_ns);
+    return ret;
+}
+
+static ssize_t spacing_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", READ_ONCE(fib_ckpt_spacing));
+}
+
+static ssize_t spacing_store(struct device *dev,
+                             struct device_attribute *attr,
+                             const char *buf,
+                             size_t count)
+{
+    long long val;
+    int rc = kstrtoll(buf, 0, &val);
+    if (rc)
+        return rc;
+    if (val < 0)
+        return -EINVAL;
+
+    WRITE_ONCE(fib_ckpt_spacing, val);
+    fib_ckpt_rebuild();
+    return count;
+}
+static DEVICE_ATTR_RW(spacing);
+
+static ssize_t max_bytes_show(struct device *dev,
+                              struct device_attribute *attr,
+                              char *buf)
+{
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(fib_ckpt_max_bytes));
+}
+
+static ssize_t max_bytes_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf,
+                               size_t count)
+{
+    unsigned long val;
+    int rc = kstrtoul(buf, 0, &val);
+    if (rc)
+        return rc;
+
+    WRITE_ONCE(fib_ckpt_max_bytes, val);
+    fib_ckpt_rebuild();
+    return count;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+static ssize_t entries_show(struct device *dev,
+                            struct device_attribute *attr,
+                            char *buf)
+{
+    struct fib_ckpt_table *t = fib_ckpt_get();
+    unsigned int n = t ? t->n : 0;
+
+    if (t)
+        fib_ckpt_put(t);
+    return sysfs_emit(buf, "%u\n", n);
+}
+static DEVICE_ATTR_RO(entries);
+
+static ssize_t bytes_show(struct device *dev,
+                          struct device_attribute *attr,
+                          char *buf)
+{
+    struct fib_ckpt_table *t = fib_ckpt_get();
+    size_t bytes = t ? t->bytes : 0;
+
+    if (t)
+        fib_ckpt_put(t);
+    return sysfs_emit(buf, "%zu\n", bytes);
+}
+static DEVICE_ATTR_RO(bytes);
+
+static ssize_t hits_show(struct device *dev,
+                         struct device_attribute *attr,
+                         char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&fib_ckpt_hits));
+}
+static DEVICE_ATTR_RO(hits);
+
+static ssize_t misses_show(struct device *dev,
+                           struct device_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&fib_ckpt_misses));
+}
+static DEVICE_ATTR_RO(misses);
+
+/* Mean nanoseconds per pair from a checkpoint and from scratch */
+static ssize_t latency_ns_show(struct device *dev,
+                               struct device_attribute *attr,
+                               char *buf)
+{
+    s64 hits = atomic64_read(&fib_ckpt_hits);
+    s64 misses = atomic64_read(&fib_ckpt_misses);
+
+    return sysfs_emit(
+        buf, "%lld %lld\n",
+        hits ? div64_s64(atomic64_read(&fib_ckpt_hit_ns), hits) : 0,
+        misses ? div64_s64(atomic64_read(&fib_ckpt_miss_ns), misses) : 0);
+}
+static DEVICE_ATTR_RO(latency_ns);
+
+static struct attribute *fib_ckpt_attrs[] = {
+    &dev_attr_spacing.attr,    &dev_attr_max_bytes.attr,
+    &dev_attr_entries.attr,    &dev_attr_bytes.attr,
+    &dev_attr_hits.attr,       &dev_attr_misses.attr,
+    &dev_attr_latency_ns.attr,
+    NULL,
+};
+
+const struct attribute_group fib_ckpt_group = {
+    .name = "checkpoint",
+    .attrs = fib_ckpt_attrs,
+};
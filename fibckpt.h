@@ -0,0 +1,25 @@
+#ifndef _FIBCKPT_H_
+#define _FIBCKPT_H_
+
+#include "bignum.h"
+
+struct attribute_group;
+
+/* Build the checkpoint table for offsets up to max_k */
+void fib_ckpt_init(long long max_k);
+void fib_ckpt_exit(void);
+
+/* Rebuild the table for a new largest offset, a no-op before init */
+void fib_ckpt_set_max(long long max_k);
+
+/*
+ * (A, B) = (F(k), F(k + 1)), starting from the nearest checkpoint below k
+ * when that is cheaper than fast doubling from scratch. Scratch comes from
+ * ar, or the heap for NULL. Return 0 or -ENOMEM.
+ */
+int fib_ckpt_pair(bn *a, bn *b, long long k, struct bn_arena *ar);
+
+/* sysfs limits and the memory/latency tradeoff, for the fibonacci device */
+extern const struct attribute_group fib_ckpt_group;
+
+#endif
@@ -5,12 +5,28 @@
 #include <linux/init.h>
 #include <linux/kdev_t.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/perf_event.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 #include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include "bignum.h"
+#include "fibcache.h"
+#include "fibckpt.h"
+#include "fibdrv.h"
+#include "fibstat.h"
+#include "fibtrace.h"
 
 
 MODULE_LICENSE("Dual MIT/GPL");
@@ -20,18 +36,97 @@ MODULE_VERSION("0.1");
 
 #define DEV_FIBONACCI_NAME "fibonacci"
 
-/* MAX_LENGTH is set to 92 because
- * ssize_t can't fit the number > 92
- */
-#define MAX_LENGTH 10000
+static long fib_max_length = 10000000;
+
+/* The checkpoints only go as far as the largest offset */
+static int fib_max_length_set(const char *val, const struct kernel_param *kp)
+{
+    int rc = param_set_long(val, kp);
+
+    if (!rc)
+        fib_ckpt_set_max(READ_ONCE(fib_max_length));
+    return rc;
+}
+
+static const struct kernel_param_ops fib_max_length_ops = {
+    .set = fib_max_length_set,
+    .get = param_get_long,
+};
+module_param_cb(max_length, &fib_max_length_ops, &fib_max_length, 0644);
+MODULE_PARM_DESC(max_length, "Largest offset served");
+
+static unsigned long fib_mem_cap = 256UL << 20;
+module_param_named(mem_cap, fib_mem_cap, ulong, 0644);
+MODULE_PARM_DESC(mem_cap,
+                 "Bytes one request may use, larger ones fail with EFBIG");
+
+module_param_named(karatsuba_threshold, bn_karatsuba_threshold, uint, 0644);
+MODULE_PARM_DESC(karatsuba_threshold,
+                 "Limb count from which bn_mult uses Karatsuba");
+module_param_named(toom3_threshold, bn_toom3_threshold, uint, 0644);
+MODULE_PARM_DESC(toom3_threshold, "Limb count from which bn_mult uses Toom-3");
+module_param_named(ntt_threshold, bn_ntt_threshold, uint, 0644);
+MODULE_PARM_DESC(ntt_threshold,
+                 "Limb count from which bn_mult uses a three prime NTT, 0 to "
+                 "disable");
+
+module_param_named(par_threshold, bn_par_threshold, uint, 0644);
+MODULE_PARM_DESC(par_threshold,
+                 "Limb count from which fast doubling runs its products in "
+                 "parallel, 0 to disable");
+module_param_named(par_split_threshold, bn_par_split_threshold, uint, 0644);
+MODULE_PARM_DESC(par_split_threshold,
+                 "Limb count from which one product is split across "
+                 "workers, 0 to disable");
+
+static bool fib_asm = true;
+
+static int fib_asm_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int rc = kstrtobool(val, &on);
+
+    if (!rc)
+        rc = bn_set_asm(on);
+    if (!rc)
+        fib_asm = on;
+    return rc;
+}
+
+static int fib_asm_get(char *buffer, const struct kernel_param *kp)
+{
+    return sysfs_emit(buffer, "%c\n", bn_asm_enabled() ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops fib_asm_ops = {
+    .set = fib_asm_set,
+    .get = fib_asm_get,
+};
+module_param_cb(asm_kernels, &fib_asm_ops, NULL, 0644);
+MODULE_PARM_DESC(asm_kernels,
+                 "Use the x86-64 BMI2/ADX limb loops, on by default where "
+                 "the CPU has them");
+
+static int fib_alloc_count_get(char *buffer, const struct kernel_param *kp)
+{
+    return sysfs_emit(buffer, "%ld\n", bn_alloc_count());
+}
+
+static const struct kernel_param_ops fib_alloc_count_ops = {
+    .get = fib_alloc_count_get,
+};
+module_param_cb(alloc_count, &fib_alloc_count_ops, NULL, 0444);
+MODULE_PARM_DESC(alloc_count, "Bignum buffer allocations since load");
 
 static dev_t fib_dev = 0;
 static struct class *fib_class;
-static DEFINE_MUTEX(fib_mutex);
 static int major = 0, minor = 0;
 
 typedef long long (*fib_ft)(long long);
 
+/* Hardware counters of FIB_IOC_MEASURE */
+#define FIB_MEASURE_EVENTS 4
+
 struct fib_ctx {
     struct perf_event *pe;
     int cpu;
@@ -39,26 +134,66 @@ struct fib_ctx {
     long long k;
     unsigned long long cycle;
     long long result;
+    struct mutex lock;     /* serializes requests on this file */
+    struct bn_arena arena; /* bignum memory, reset after each request */
+    bn_t seq_a, seq_b;     /* F(seq_k), F(seq_k + 1) of the last request */
+    long long seq_k;       /* -1 until the pair is computed */
+    unsigned int format;   /* enum fib_format of reads and ranges */
+    struct mutex map_lock; /* map and map_size, taken inside lock */
+    void *map;             /* vmalloc_user area for FIB_IOC_MAP */
+    size_t map_size;       /* bytes at map */
+    atomic_t map_users;    /* live mappings of map */
+    char *stream;          /* tail of a result that did not fit a read */
+    size_t stream_len;
+    size_t stream_pos;
+    long long stream_k; /* offset of stream, -1 if none */
+    spinlock_t async_lock;       /* the async_* fields */
+    struct list_head async_reqs; /* struct fib_async, in submit order */
+    unsigned int async_count;    /* submitted and not yet read */
+    unsigned int async_ready;    /* finished and not yet read */
+    unsigned int read_mode;      /* enum fib_read_mode */
+    wait_queue_head_t async_wait; /* also woken for ring completions */
+    struct fib_ring *ring;        /* FIB_IOC_RING_SETUP, set once */
+    struct perf_event *mpe[FIB_MEASURE_EVENTS]; /* on mcpu */
+    int mcpu;
+    struct fib_measure *measure; /* request of fib_measure_delta */
 };
 
+static struct kmem_cache *fib_ctx_cache;
+
 struct perf_event_attr attr = {.type = PERF_TYPE_HARDWARE,
                                .size = sizeof(attr),
                                .config = PERF_COUNT_HW_CPU_CYCLES,
                                .disabled = 0,
                                .exclude_hv = 1,
                                .pinned = 1,
-                               .exclusive = 1,
                                .exclude_kernel = 0,
                                .read_format = 0};
 
+/*
+ * Offsets at most this far past the last one are reached by additions,
+ * which cost a few limb passes each, instead of a fresh fast doubling
+ */
+#define FIB_SEQ_STEP_MAX 256
+
+/*
+ * A pinned counter that cannot get onto its CPU, e.g. next to an exclusive
+ * one of someone else, is put in error state and reads 0. It only counted
+ * all of a call if it was running the whole time it was enabled.
+ */
+static bool fib_pe_ran(u64 en0, u64 run0, u64 en1, u64 run1)
+{
+    return run1 != run0 && run1 - run0 == en1 - en0;
+}
+
 /*
  * Timing function for fib_sequence* function
  */
 static long fib_cycle_delta(void *data)
 {
     struct fib_ctx *fc = data;
-    unsigned long long v0 = 0, en0 = 0, run0 = 0;
-    unsigned long long v1 = 0, en1 = 0, run1 = 0;
+    u64 v0 = 0, en0 = 0, run0 = 0;
+    u64 v1 = 0, en1 = 0, run1 = 0;
     v0 = perf_event_read_value(fc->pe, &en0, &run0);
 
     fc->result = fc->func(fc->k);
@@ -66,13 +201,13 @@ static long fib_cycle_delta(void *data)
     v1 = perf_event_read_value(fc->pe, &en1, &run1);
 
     fc->cycle = v1 - v0;
-    return 0;
+    return fib_pe_ran(en0, run0, en1, run1) ? 0 : -EBUSY;
 }
 
-static long long fib_time_proxy(struct fib_ctx *fc)
+/* Time fc->func on fc->cpu, return 0 or -EBUSY without a counter there */
+static long fib_time_proxy(struct fib_ctx *fc)
 {
-    work_on_cpu(fc->cpu, fib_cycle_delta, fc);
-    return fc->result;
+    return work_on_cpu(fc->cpu, fib_cycle_delta, fc);
 }
 
 
@@ -182,30 +317,167 @@ static long fib_create_pe_oncpu(void *data)
 }
 
 
-static int fib_open(struct inode *inode, struct file *file)
+/*
+ * Workers of fib_par_run. Range and async workers wait on them from
+ * system_unbound_wq, sharing its max_active could leave no slot for them.
+ */
+static struct workqueue_struct *fib_par_wq;
+
+/* A job of fib_par_run, on the caller's stack */
+struct fib_par_job {
+    struct work_struct work;
+    bn_job_fn fn;
+    void *arg;
+};
+
+static void fib_par_work(struct work_struct *work)
 {
-    if (!mutex_trylock(&fib_mutex)) {
-        printk(KERN_ALERT "fibdrv is in use\n");
-        return -EBUSY;
+    struct fib_par_job *job = container_of(work, struct fib_par_job, work);
+    job->fn(job->arg);
+}
+
+/*
+ * bn_par_run for the driver, the calling thread takes the first job. A job
+ * that splits again runs its pieces itself: workers blocked on workers of
+ * the same queue could take every slot and wait on each other forever.
+ */
+static void fib_par_run(bn_job_fn fn, void **arg, unsigned int n)
+{
+    struct work_struct *cur = current_work();
+    struct fib_par_job job[BN_PAR_MAX];
+
+    if (cur && cur->func == fib_par_work) {
+        for (unsigned int i = 0; i < n; i++)
+            fn(arg[i]);
+        return;
     }
-    struct fib_ctx *fc = kzalloc(sizeof(*fc), GFP_KERNEL);
-    if (!fc)
-        return -ENOMEM;
 
-    fc->cpu = smp_processor_id();
+    for (unsigned int i = 1; i < n; i++) {
+        INIT_WORK_ONSTACK(&job[i].work, fib_par_work);
+        job[i].fn = fn;
+        job[i].arg = arg[i];
+        queue_work(fib_par_wq, &job[i].work);
+    }
+    fn(arg[0]);
+    for (unsigned int i = 1; i < n; i++) {
+        flush_work(&job[i].work);
+        destroy_work_on_stack(&job[i].work);
+    }
+}
+
+/* Create the cycle counter on first use, so plain readers never pay for it */
+static long fib_create_pe(struct fib_ctx *fc)
+{
+    if (fc->pe)
+        return 0;
+
+    fc->cpu = raw_smp_processor_id();
 
-    if (!cpu_online(fc->cpu)) {
-        kfree(fc);
+    if (!cpu_online(fc->cpu))
         return -EINVAL;
-    }
 
     long ret = work_on_cpu(fc->cpu, fib_create_pe_oncpu, fc);
 
-    if (ret) {
-        kfree(fc);
-        return ret;
+    if (ret)
+        fc->pe = NULL;
+    return ret;
+}
+
+static unsigned int fib_async_max = 64;
+module_param_named(async_max, fib_async_max, uint, 0644);
+MODULE_PARM_DESC(async_max, "Outstanding FIB_IOC_SUBMIT requests per open");
+
+/* A request of FIB_IOC_SUBMIT, computed on a workqueue */
+struct fib_async {
+    struct work_struct work;
+    struct list_head node; /* fc->async_reqs */
+    struct fib_ctx *fc;
+    long long k;
+    u64 tag;
+    unsigned int format;
+    bool done; /* under fc->async_lock, err and out are set */
+    int err;
+    char *out; /* the result, len bytes */
+    size_t len;
+};
+
+static void fib_async_free(struct fib_async *req)
+{
+    kvfree(req->out);
+    kfree(req);
+}
+
+/* Wait for the requests still running and drop every result, at release */
+static void fib_async_exit(struct fib_ctx *fc)
+{
+    struct fib_async *req, *tmp;
+
+    list_for_each_entry_safe (req, tmp, &fc->async_reqs, node) {
+        cancel_work_sync(&req->work);
+        fib_async_free(req);
     }
+}
+
+/* Largest FIB_IOC_RING_SETUP */
+#define FIB_RING_MAX_ENTRIES 4096
+#define FIB_RING_MAX_AREA (256 << 20)
+
+static unsigned int fib_ring_idle_us = 1000;
+module_param_named(ring_idle_us, fib_ring_idle_us, uint, 0644);
+MODULE_PARM_DESC(ring_idle_us,
+                 "Microseconds a FIB_RING_SQPOLL thread polls before sleeping");
+
+/*
+ * The kernel side of a ring. The shared region is written by user space at
+ * any time, so the driver keeps its own copy of every index it owns and
+ * only trusts sq_tail and cq_head after checking them against those.
+ */
+struct fib_ring {
+    struct fib_ctx *fc;
+    void *map; /* vmalloc_user region, struct fib_ring_hdr first */
+    struct fib_ring_hdr *hdr;
+    struct fib_submit *sqes;
+    struct fib_cqe *cqes;
+    char *area;
+    u64 area_size;
+    unsigned int mask;
+    u32 sq_head, sq_seen; /* next SQE, sq_tail at the last drain */
+    u32 cq_head, cq_tail; /* completions user space still holds */
+    u64 area_head, area_tail; /* bytes freed and used, running */
+    u64 *area_end;            /* area_tail after each CQ slot */
+    struct work_struct work;  /* drains for the doorbell */
+    struct task_struct *poller;
+    wait_queue_head_t wait; /* the poller sleeps here */
+    bool kick;              /* doorbell rung while the poller slept */
+};
+
+static void fib_ring_free(struct fib_ring *r)
+{
+    if (r->poller)
+        kthread_stop(r->poller);
+    cancel_work_sync(&r->work);
+    vfree(r->map);
+    kvfree(r->area_end);
+    kfree(r);
+}
+
+static int fib_open(struct inode *inode, struct file *file)
+{
+    struct fib_ctx *fc = kmem_cache_zalloc(fib_ctx_cache, GFP_KERNEL);
+    if (!fc)
+        return -ENOMEM;
 
+    mutex_init(&fc->lock);
+    mutex_init(&fc->map_lock);
+    bn_arena_init(&fc->arena);
+    /* the pair outlives every reset, only its scratch comes from arena */
+    bn_init(fc->seq_a);
+    bn_init(fc->seq_b);
+    fc->seq_k = -1;
+    fc->stream_k = -1;
+    spin_lock_init(&fc->async_lock);
+    INIT_LIST_HEAD(&fc->async_reqs);
+    init_waitqueue_head(&fc->async_wait);
     file->private_data = fc;
 
     return 0;
@@ -213,30 +485,518 @@ static int fib_open(struct inode *inode, struct file *file)
 
 static int fib_release(struct inode *inode, struct file *file)
 {
-    mutex_unlock(&fib_mutex);
     struct fib_ctx *fc = file->private_data;
     if (fc) {
-        if (fc->pe && !IS_ERR(fc->pe))
+        if (fc->pe)
             perf_event_release_kernel(fc->pe);
-        kfree(fc);
+        for (unsigned int i = 0; i < ARRAY_SIZE(fc->mpe); i++) {
+            if (fc->mpe[i])
+                perf_event_release_kernel(fc->mpe[i]);
+        }
+        fib_async_exit(fc);
+        if (fc->ring)
+            fib_ring_free(fc->ring);
+        bn_free(fc->seq_a);
+        bn_free(fc->seq_b);
+        bn_arena_destroy(&fc->arena);
+        vfree(fc->map);
+        kvfree(fc->stream);
+        mutex_destroy(&fc->map_lock);
+        mutex_destroy(&fc->lock);
+        kmem_cache_free(fib_ctx_cache, fc);
     }
     return 0;
 }
 
-/* calculate the fibonacci number at given offset */
+/* Refuse offsets whose computation would pass the memory cap */
+static int fib_check_mem(long long k)
+{
+    return bn_fib_mem(k) > READ_ONCE(fib_mem_cap) ? -EFBIG : 0;
+}
+
+/* Make fc->seq_a F(k), fc->lock held */
+static int fib_seek(struct fib_ctx *fc, long long k)
+{
+    int ret = fib_check_mem(k);
+    if (ret)
+        return ret;
+
+    /* sequential sweeps step the pair of the previous read forward */
+    long long d = k - fc->seq_k;
+    if (fc->seq_k >= 0 && d >= 0 && d <= FIB_SEQ_STEP_MAX)
+        ret = bn_fib_advance(fc->seq_a, fc->seq_b, d);
+    else
+        ret = fib_ckpt_pair(fc->seq_a, fc->seq_b, k, &fc->arena);
+    /* a failed step leaves the pair somewhere in between */
+    fc->seq_k = ret ? -1 : k;
+    return ret;
+}
+
+/* Bytes fib_render_into() may write for P in format fmt */
+static size_t fib_render_size(const bn *p, unsigned int fmt)
+{
+    switch (fmt) {
+    case FIB_FMT_HEX:
+        return bn_to_hex_size(p);
+    case FIB_FMT_RAW:
+        return sizeof(struct fib_raw) + sizeof(bn_data) * p->size;
+    default:
+        return bn_to_string_size(p);
+    }
+}
+
+/*
+ * Render P in format fmt to out, of fib_render_size() bytes, with scratch
+ * from ar. Return the bytes of the result, 0 when out of memory. The digit
+ * formats are also NUL terminated.
+ */
+static size_t fib_render_into(const bn *p,
+                              unsigned int fmt,
+                              struct bn_arena *ar,
+                              char *out)
+{
+    switch (fmt) {
+    case FIB_FMT_HEX:
+        return bn_to_hex_buf(p, out);
+    case FIB_FMT_RAW: {
+        struct fib_raw hdr = {
+            .sign = p->sign,
+            .limb_bytes = sizeof(bn_data),
+            .limbs = p->size,
+        };
+        memcpy(out, &hdr, sizeof(hdr));
+        bn_to_le(p, out + sizeof(hdr), p->size);
+        return sizeof(hdr) + sizeof(bn_data) * p->size;
+    }
+    default:
+        return bn_to_string_buf(p, out, ar);
+    }
+}
+
+/*
+ * Render P in format fmt with memory from ar, *len gets the bytes of the
+ * result. The digit formats are also NUL terminated.
+ */
+static char *fib_render(const bn *p,
+                        unsigned int fmt,
+                        struct bn_arena *ar,
+                        size_t *len)
+{
+    char *out = bn_arena_alloc(ar, fib_render_size(p, fmt));
+
+    if (out) {
+        *len = fib_render_into(p, fmt, ar, out);
+        if (!*len)
+            out = NULL;
+    }
+    return out;
+}
+
+/* Phase times of one request, for fib_stat and the tracepoints */
+struct fib_req_stat {
+    long long k;
+    u64 t; /* end of the last phase */
+    u64 ns[FIB_PHASES];
+    unsigned int phases; /* bit per phase that ran */
+};
+
+static void fib_req_begin(struct fib_req_stat *st,
+                          long long k,
+                          unsigned int fmt)
+{
+    trace_fib_request_start(k, fmt);
+    memset(st, 0, sizeof(*st));
+    st->k = k;
+    st->t = ktime_get_ns();
+}
+
+/* Charge the time since the last phase to ph */
+static void fib_req_mark(struct fib_req_stat *st, enum fib_phase ph)
+{
+    u64 now = ktime_get_ns();
+
+    st->ns[ph] += now - st->t;
+    st->phases |= 1U << ph;
+    st->t = now;
+}
+
+static long fib_req_end(struct fib_req_stat *st, long ret)
+{
+    for (int ph = 0; ph < FIB_PHASES; ph++) {
+        if (st->phases & (1U << ph))
+            fib_stat_add(ph, st->k, st->ns[ph]);
+    }
+    trace_fib_request_end(st->k, ret, st->ns[FIB_PHASE_COMPUTE],
+                          st->ns[FIB_PHASE_RENDER], st->ns[FIB_PHASE_COPY]);
+    return ret;
+}
+
+static void fib_stream_drop(struct fib_ctx *fc)
+{
+    kvfree(fc->stream);
+    fc->stream = NULL;
+    WRITE_ONCE(fc->stream_k, -1);
+}
+
+/*
+ * Copy n bytes of src for offset k to a user buffer of size bytes, the part
+ * that does not fit is kept for the next reads of k. Return the bytes still
+ * pending, fc->lock held.
+ */
+static ssize_t fib_deliver(struct fib_ctx *fc,
+                           long long k,
+                           char __user *buf,
+                           size_t size,
+                           const char *src,
+                           size_t n)
+{
+    size_t part = min(size, n);
+
+    fib_stream_drop(fc);
+    if (copy_to_user(buf, src, part))
+        return -EFAULT;
+    if (part == n)
+        return 0;
+
+    fc->stream = kvmalloc(n - part, GFP_KERNEL);
+    if (!fc->stream)
+        return -ENOMEM;
+    memcpy(fc->stream, src + part, n - part);
+    fc->stream_len = n - part;
+    fc->stream_pos = 0;
+    WRITE_ONCE(fc->stream_k, k);
+    return n - part;
+}
+
+/* fib_deliver() for callers without fc->lock, it is only taken for a tail */
+static ssize_t fib_deliver_unlocked(struct fib_ctx *fc,
+                                    long long k,
+                                    char __user *buf,
+                                    size_t size,
+                                    const char *src,
+                                    size_t n)
+{
+    if (n <= size)
+        return copy_to_user(buf, src, n) ? -EFAULT : 0;
+
+    if (mutex_lock_interruptible(&fc->lock))
+        return -ERESTARTSYS;
+    ssize_t ret = fib_deliver(fc, k, buf, size, src, n);
+    mutex_unlock(&fc->lock);
+    return ret;
+}
+
+/* Next part of a result that did not fit, fc->lock held */
+static ssize_t fib_stream_next(struct fib_ctx *fc,
+                               char __user *buf,
+                               size_t size)
+{
+    size_t part = min(size, fc->stream_len - fc->stream_pos);
+
+    if (copy_to_user(buf, fc->stream + fc->stream_pos, part))
+        return -EFAULT;
+    fc->stream_pos += part;
+
+    ssize_t pending = fc->stream_len - fc->stream_pos;
+    if (!pending)
+        fib_stream_drop(fc);
+    return pending;
+}
+
+/* Render F(k) into req->out, from the cache when it has it */
+static int fib_async_compute(struct fib_async *req)
+{
+    struct fib_req_stat st;
+    fib_req_begin(&st, req->k, req->format);
+
+    struct fib_cache_entry *e =
+        req->format == FIB_FMT_DEC ? fib_cache_get(req->k) : NULL;
+    if (e) {
+        req->out = kvmalloc(e->len, GFP_KERNEL);
+        if (req->out) {
+            memcpy(req->out, e->str, e->len);
+            req->len = e->len;
+        }
+        fib_cache_put(e);
+        return fib_req_end(&st, req->out ? 0 : -ENOMEM);
+    }
+
+    struct bn_arena arena;
+    bn_t a, b;
+    size_t len;
+    bn_init(a);
+    bn_init(b);
+    bn_arena_init(&arena);
+
+    char *out = NULL;
+    if (!fib_ckpt_pair(a, b, req->k, &arena)) {
+        fib_req_mark(&st, FIB_PHASE_COMPUTE);
+        out = fib_render(a, req->format, &arena, &len);
+        fib_req_mark(&st, FIB_PHASE_RENDER);
+    }
+    if (out) {
+        req->out = kvmalloc(len, GFP_KERNEL);
+        if (req->out) {
+            memcpy(req->out, out, len);
+            req->len = len;
+        }
+        if (req->format == FIB_FMT_DEC)
+            fib_cache_insert(req->k, out, len);
+    }
+
+    bn_arena_destroy(&arena);
+    bn_free(a);
+    bn_free(b);
+    return fib_req_end(&st, req->out ? 0 : -ENOMEM);
+}
+
+static void fib_async_work(struct work_struct *work)
+{
+    struct fib_async *req = container_of(work, struct fib_async, work);
+    struct fib_ctx *fc = req->fc;
+
+    req->err = fib_async_compute(req);
+
+    spin_lock(&fc->async_lock);
+    req->done = true;
+    fc->async_ready++;
+    spin_unlock(&fc->async_lock);
+    wake_up_interruptible_poll(&fc->async_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/* Unlink the oldest finished request, or return NULL */
+static struct fib_async *fib_async_pop(struct fib_ctx *fc)
+{
+    struct fib_async *req;
+
+    spin_lock(&fc->async_lock);
+    list_for_each_entry (req, &fc->async_reqs, node) {
+        if (req->done) {
+            list_del(&req->node);
+            fc->async_ready--;
+            spin_unlock(&fc->async_lock);
+            return req;
+        }
+    }
+    spin_unlock(&fc->async_lock);
+    return NULL;
+}
+
+/* Hand a popped request back, or drop it and free its slot */
+static void fib_async_push(struct fib_ctx *fc, struct fib_async *req, bool keep)
+{
+    spin_lock(&fc->async_lock);
+    if (keep) {
+        list_add(&req->node, &fc->async_reqs);
+        fc->async_ready++;
+    } else {
+        fc->async_count--;
+    }
+    spin_unlock(&fc->async_lock);
+
+    if (!keep) {
+        fib_async_free(req);
+        wake_up_interruptible_poll(&fc->async_wait, EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+/* Whether a completion is ready or none can come any more, a hint */
+static bool fib_async_readable(struct fib_ctx *fc)
+{
+    return READ_ONCE(fc->async_ready) || !READ_ONCE(fc->async_count);
+}
+
+/*
+ * Copy out as many whole completion records as fit in buf, waiting for the
+ * first one unless nonblock
+ */
+static ssize_t fib_async_read(struct fib_ctx *fc,
+                              char __user *buf,
+                              size_t size,
+                              bool nonblock)
+{
+    struct fib_async *req;
+    ssize_t used = 0;
+
+    if (size < sizeof(struct fib_completion))
+        return -EINVAL;
+    if (!nonblock &&
+        wait_event_interruptible(fc->async_wait, fib_async_readable(fc)))
+        return -ERESTARTSYS;
+
+    while ((req = fib_async_pop(fc))) {
+        struct fib_completion c = {
+            .k = req->k,
+            .tag = req->tag,
+            .err = req->err,
+            .format = req->format,
+            .len = req->len,
+        };
+        bool fit = used + sizeof(c) + req->len <= size;
+
+        /* a record too large for the buffer still tells its size */
+        if (!fit && used) {
+            fib_async_push(fc, req, true);
+            break;
+        }
+        if (copy_to_user(buf + used, &c, sizeof(c)) ||
+            (fit && copy_to_user(buf + used + sizeof(c), req->out, req->len))) {
+            fib_async_push(fc, req, false);
+            return used ? used : -EFAULT;
+        }
+        used += sizeof(c);
+        if (!fit) {
+            fib_async_push(fc, req, true);
+            break;
+        }
+        used += req->len;
+        fib_async_push(fc, req, false);
+    }
+    if (used || !nonblock)
+        return used;
+    return -EAGAIN;
+}
+
+static long fib_ioctl_submit(struct fib_ctx *fc, struct fib_submit __user *arg)
+{
+    struct fib_submit s;
+    if (copy_from_user(&s, arg, sizeof(s)))
+        return -EFAULT;
+    if (s.k < 0 || s.k > READ_ONCE(fib_max_length))
+        return -EINVAL;
+    long ret = fib_check_mem(s.k);
+    if (ret)
+        return ret;
+
+    struct fib_async *req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+    INIT_WORK(&req->work, fib_async_work);
+    req->fc = fc;
+    req->k = s.k;
+    req->tag = s.tag;
+    req->format = READ_ONCE(fc->format);
+
+    spin_lock(&fc->async_lock);
+    if (fc->async_count >= READ_ONCE(fib_async_max)) {
+        spin_unlock(&fc->async_lock);
+        kfree(req);
+        return -EAGAIN;
+    }
+    fc->async_count++;
+    list_add_tail(&req->node, &fc->async_reqs);
+    spin_unlock(&fc->async_lock);
+
+    queue_work(system_unbound_wq, &req->work);
+    return 0;
+}
+
+static __poll_t fib_poll(struct file *file, poll_table *wait)
+{
+    struct fib_ctx *fc = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &fc->async_wait, wait);
+    spin_lock(&fc->async_lock);
+    if (fc->async_ready)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (fc->async_count < READ_ONCE(fib_async_max))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&fc->async_lock);
+
+    struct fib_ring *r = smp_load_acquire(&fc->ring);
+    if (r && READ_ONCE(r->hdr->cq_tail) != READ_ONCE(r->hdr->cq_head))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/*
+ * calculate the fibonacci number at given offset
+ *
+ * Return the bytes of the result that did not fit in buf. Reading the same
+ * offset again continues with them, until 0 says the result is complete.
+ * In FIB_READ_COMPLETIONS mode it reads FIB_IOC_SUBMIT completions instead.
+ */
 static ssize_t fib_read(struct file *file,
                         char *buf,
                         size_t size,
                         loff_t *offset)
 {
-    bn_t fib;
-    bn_init(fib);
-    bn_fib_fdoubling(fib, *offset);
-    char *fib_str = bn_to_string(fib);
-    size_t remain = copy_to_user(buf, fib_str, strlen(fib_str) + 1);
-    kfree(fib_str);
-    bn_free(fib);
-    return (ssize_t) remain;
+    struct fib_ctx *fc = file->private_data;
+    unsigned int fmt = READ_ONCE(fc->format);
+    ssize_t ret = -ENOMEM;
+
+    if (READ_ONCE(fc->read_mode) == FIB_READ_COMPLETIONS)
+        return fib_async_read(fc, buf, size, file->f_flags & O_NONBLOCK);
+
+    /* pread() gets here with any offset, lseek() never goes past the limit */
+    if (*offset < 0 || *offset > READ_ONCE(fib_max_length))
+        return -EINVAL;
+
+    if (READ_ONCE(fc->stream_k) == *offset) {
+        if (mutex_lock_interruptible(&fc->lock))
+            return -ERESTARTSYS;
+        if (fc->stream_k == *offset) {
+            ret = fib_stream_next(fc, buf, size);
+            mutex_unlock(&fc->lock);
+            return ret;
+        }
+        mutex_unlock(&fc->lock);
+    }
+
+    struct fib_req_stat st;
+    fib_req_begin(&st, *offset, fmt);
+
+    /* small results fit in the inline limbs, no lock or arena needed */
+    if (fmt == FIB_FMT_DEC && *offset <= BN_FIB_INLINE_MAX) {
+        char str[BN_INLINE_STR];
+        bn_t fib;
+        bn_init(fib);
+        bn_fib_fdoubling(fib, *offset);
+        fib_req_mark(&st, FIB_PHASE_COMPUTE);
+        size_t n = bn_to_string_inline(fib, str) + 1;
+        fib_req_mark(&st, FIB_PHASE_RENDER);
+        ret = fib_deliver_unlocked(fc, *offset, buf, size, str, n);
+        fib_req_mark(&st, FIB_PHASE_COPY);
+        return fib_req_end(&st, ret);
+    }
+
+    /* the cache holds decimal strings only */
+    struct fib_cache_entry *e =
+        fmt == FIB_FMT_DEC ? fib_cache_get(*offset) : NULL;
+    if (e) {
+        ret = fib_deliver_unlocked(fc, *offset, buf, size, e->str, e->len + 1);
+        fib_req_mark(&st, FIB_PHASE_COPY);
+        fib_cache_put(e);
+        return fib_req_end(&st, ret);
+    }
+
+    if (mutex_lock_interruptible(&fc->lock))
+        return fib_req_end(&st, -ERESTARTSYS);
+    /* waiting for the lock is no phase of this request */
+    st.t = ktime_get_ns();
+
+    ret = fib_seek(fc, *offset);
+    if (ret)
+        goto out;
+    fib_req_mark(&st, FIB_PHASE_COMPUTE);
+
+    size_t len;
+    char *out = fib_render(fc->seq_a, fmt, &fc->arena, &len);
+    fib_req_mark(&st, FIB_PHASE_RENDER);
+    ret = -ENOMEM;
+    if (out) {
+        ret = fib_deliver(fc, *offset, buf, size, out,
+                          len + (fmt != FIB_FMT_RAW));
+        fib_req_mark(&st, FIB_PHASE_COPY);
+        if (fmt == FIB_FMT_DEC)
+            fib_cache_insert(*offset, out, len);
+    }
+out:
+    /* the scratch of a failed seek is in there too */
+    bn_arena_reset(&fc->arena);
+    mutex_unlock(&fc->lock);
+    return fib_req_end(&st, ret);
 }
 
 /*
@@ -249,25 +1009,802 @@ static ssize_t fib_write(struct file *file,
                          loff_t *offset)
 {
     struct fib_ctx *fc = file->private_data;
-    fc->k = *offset;
+    fib_ft func;
     switch (size) {
     case 0:
-        fc->func = fib_sequence;
+        func = fib_sequence;
         break;
     case 1:
-        fc->func = fib_sequence2;
+        func = fib_sequence2;
         break;
     case 2:
-        fc->func = fib_sequence_fdoubling;
+        func = fib_sequence_fdoubling;
         break;
     case 3:
-        fc->func = fib_sequence_fdoubling_clz;
+        func = fib_sequence_fdoubling_clz;
         break;
     default:
         return 1;
     }
-    fib_time_proxy(fc);
-    return (ssize_t) fc->cycle;
+
+    if (mutex_lock_interruptible(&fc->lock))
+        return -ERESTARTSYS;
+
+    ssize_t ret = fib_create_pe(fc);
+    if (!ret) {
+        fc->k = *offset;
+        fc->func = func;
+        ret = fib_time_proxy(fc) ?: (ssize_t) fc->cycle;
+    }
+
+    mutex_unlock(&fc->lock);
+    return ret;
+}
+
+/* Counters of FIB_IOC_MEASURE, in the order of struct fib_measure */
+static const u64 fib_measure_events[FIB_MEASURE_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/*
+ * Open the counters on the current CPU on first use. In-kernel counters
+ * cannot form a perf group, so each is pinned on its own instead and all
+ * are read back to back around the call.
+ */
+static long fib_create_measure(struct fib_ctx *fc)
+{
+    if (fc->mpe[0])
+        return 0;
+
+    fc->mcpu = raw_smp_processor_id();
+    for (unsigned int i = 0; i < ARRAY_SIZE(fib_measure_events); i++) {
+        struct perf_event_attr a = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(a),
+            .config = fib_measure_events[i],
+            .pinned = 1,
+            .exclude_hv = 1,
+        };
+        struct perf_event *pe =
+            perf_event_create_kernel_counter(&a, fc->mcpu, NULL, NULL, NULL);
+
+        if (IS_ERR(pe)) {
+            while (i--) {
+                perf_event_release_kernel(fc->mpe[i]);
+                fc->mpe[i] = NULL;
+            }
+            return PTR_ERR(pe);
+        }
+        fc->mpe[i] = pe;
+    }
+    return 0;
+}
+
+/* The measured call of FIB_IOC_MEASURE */
+static int fib_measure_call(struct fib_ctx *fc, struct fib_measure *m)
+{
+    char *str;
+
+    switch (m->algo) {
+    case FIB_ALGO_SEQUENCE:
+        m->result = fib_sequence(m->k);
+        break;
+    case FIB_ALGO_SEQUENCE2:
+        m->result = fib_sequence2(m->k);
+        break;
+    case FIB_ALGO_FDOUBLING:
+        m->result = fib_sequence_fdoubling(m->k);
+        break;
+    case FIB_ALGO_FDOUBLING_CLZ:
+        m->result = fib_sequence_fdoubling_clz(m->k);
+        break;
+    case FIB_ALGO_BN_FIB:
+        return bn_fib(fc->seq_a, m->k);
+    case FIB_ALGO_BN_FDOUBLING:
+        return bn_fib_fdoubling(fc->seq_a, m->k);
+    case FIB_ALGO_BN_TO_STRING:
+        str = bn_to_string(fc->seq_a);
+        if (!str)
+            return -ENOMEM;
+        bn_free_string(fc->seq_a, str);
+        break;
+    }
+    return 0;
+}
+
+/* Run fc->measure between two reads of every counter, on fc->mcpu */
+static long fib_measure_delta(void *data)
+{
+    struct fib_ctx *fc = data;
+    struct fib_measure *m = fc->measure;
+    u64 v0[ARRAY_SIZE(fib_measure_events)], v1[ARRAY_SIZE(v0)];
+    u64 en0[ARRAY_SIZE(v0)], run0[ARRAY_SIZE(v0)], en1, run1;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(v0); i++)
+        v0[i] = perf_event_read_value(fc->mpe[i], &en0[i], &run0[i]);
+    u64 t0 = ktime_get_ns();
+
+    int ret = fib_measure_call(fc, m);
+
+    m->ns = ktime_get_ns() - t0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(v1); i++) {
+        v1[i] = perf_event_read_value(fc->mpe[i], &en1, &run1);
+        if (!ret && !fib_pe_ran(en0[i], run0[i], en1, run1))
+            ret = -EBUSY;
+    }
+
+    m->cycles = v1[0] - v0[0];
+    m->instructions = v1[1] - v0[1];
+    m->cache_misses = v1[2] - v0[2];
+    m->branch_misses = v1[3] - v0[3];
+    return ret;
+}
+
+static long fib_ioctl_measure(struct fib_ctx *fc,
+                              struct fib_measure __user *arg)
+{
+    struct fib_measure m;
+    if (copy_from_user(&m, arg, sizeof(m)))
+        return -EFAULT;
+    if (m.k < 0 || m.k > READ_ONCE(fib_max_length) ||
+        m.algo > FIB_ALGO_BN_TO_STRING)
+        return -EINVAL;
+    /* F(93) does not fit in a long long */
+    if (m.algo <= FIB_ALGO_FDOUBLING_CLZ && m.k > 92)
+        return -ERANGE;
+    /* additions alone would hold fc->lock for minutes at max_length */
+    if (m.algo == FIB_ALGO_BN_FIB && m.k > FIB_MEASURE_BN_FIB_MAX)
+        return -ERANGE;
+    long ret = fib_check_mem(m.k);
+    if (ret)
+        return ret;
+
+    if (mutex_lock_interruptible(&fc->lock))
+        return -ERESTARTSYS;
+    ret = fib_create_measure(fc);
+    if (!ret && m.algo == FIB_ALGO_BN_TO_STRING)
+        ret = fib_seek(fc, m.k);
+    if (!ret) {
+        m.result = 0;
+        fc->measure = &m;
+        ret = work_on_cpu(fc->mcpu, fib_measure_delta, fc);
+        fc->measure = NULL;
+    }
+    /* the bignum variants leave seq_a without its partner */
+    if (m.algo == FIB_ALGO_BN_FIB || m.algo == FIB_ALGO_BN_FDOUBLING)
+        fc->seq_k = -1;
+    bn_arena_reset(&fc->arena);
+    mutex_unlock(&fc->lock);
+    if (ret)
+        return ret;
+
+    if (copy_to_user(arg, &m, sizeof(m)))
+        return -EFAULT;
+    return 0;
+}
+
+/* Largest staging buffer of one FIB_IOC_RANGE call */
+#define FIB_RANGE_MAX_BYTES (4 << 20)
+
+/* Fewest records worth handing to a worker of its own */
+#define FIB_RANGE_SEG_MIN 128
+
+static unsigned int fib_range_jobs;
+module_param_named(range_jobs, fib_range_jobs, uint, 0644);
+MODULE_PARM_DESC(range_jobs,
+                 "Workers per FIB_IOC_RANGE call, 0 for one per online CPU");
+
+/* A run of records of one FIB_IOC_RANGE call */
+struct fib_range_seg {
+    struct work_struct work;
+    long long k0, k1; /* offsets to pack */
+    long long k;      /* out: offset the pair is left at */
+    unsigned int format;
+    u64 count;        /* out: records packed */
+    char *out;
+    size_t size, used;
+    int err;
+    bn_t a, b; /* pair of a worker */
+    struct bn_arena arena;
+};
+
+/*
+ * Pack records from k0 on into seg->out with (A, B) = (F(k0), F(k0 + 1)),
+ * stepping by additions, until k1 or until the next record does not fit
+ */
+static void fib_range_fill(struct fib_range_seg *seg,
+                           bn *a,
+                           bn *b,
+                           struct bn_arena *ar)
+{
+    long long k;
+
+    seg->count = 0;
+    seg->used = 0;
+    for (k = seg->k0; k <= seg->k1; k++) {
+        size_t n;
+        char *str = NULL;
+        if (k == seg->k0 || !bn_fib_advance(a, b, 1))
+            str = fib_render(a, seg->format, ar, &n);
+        if (!str) {
+            seg->err = -ENOMEM;
+            break;
+        }
+        u32 len = n;
+        if (seg->used + sizeof(len) + len > seg->size) {
+            bn_arena_reset(ar);
+            break;
+        }
+        memcpy(seg->out + seg->used, &len, sizeof(len));
+        memcpy(seg->out + seg->used + sizeof(len), str, len);
+        seg->used += sizeof(len) + len;
+        seg->count++;
+        bn_arena_reset(ar);
+        cond_resched();
+    }
+    seg->k = min(k, seg->k1);
+}
+
+static void fib_range_work(struct work_struct *work)
+{
+    struct fib_range_seg *seg = container_of(work, struct fib_range_seg, work);
+
+    bn_init(seg->a);
+    bn_init(seg->b);
+    bn_arena_init(&seg->arena);
+    seg->err = fib_ckpt_pair(seg->a, seg->b, seg->k0, &seg->arena);
+    if (!seg->err)
+        fib_range_fill(seg, seg->a, seg->b, &seg->arena);
+    bn_arena_destroy(&seg->arena);
+    bn_free(seg->a);
+    bn_free(seg->b);
+}
+
+/*
+ * Bytes of the record of F(k), from F(k) < phi^k: at most k * log10(phi) + 1
+ * decimal digits and k * log2(phi) + 1 bits
+ */
+static size_t fib_range_bound(long long k, unsigned int fmt)
+{
+    switch (fmt) {
+    case FIB_FMT_HEX:
+        return sizeof(u32) + (u64) k * 6943 / 40000 + 2;
+    case FIB_FMT_RAW:
+        return sizeof(u32) + sizeof(struct fib_raw) +
+               ((u64) k * 6943 / 10000 / BN_BIT + 2) * sizeof(bn_data);
+    default:
+        return sizeof(u32) + (u64) k * 20899 / 100000 + 1;
+    }
+}
+
+/*
+ * Split k0..k1 into segments of about equal output, seed each worker with
+ * its own fast doubling and pack the results back to back. Only used when
+ * every record is known to fit, so no segment can stop early. Return the
+ * bytes packed or a negative errno.
+ */
+static long fib_range_parallel(struct fib_range *r,
+                               unsigned int fmt,
+                               char *out,
+                               unsigned int n)
+{
+    struct fib_range_seg *seg = kvcalloc(n, sizeof(*seg), GFP_KERNEL);
+    if (!seg)
+        return -ENOMEM;
+
+    size_t total = 0;
+    for (long long k = r->k0; k <= r->k1; k++)
+        total += fib_range_bound(k, fmt);
+
+    long long k = r->k0;
+    size_t off = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        size_t share = total / n * (i + 1), end = off;
+
+        seg[i].k0 = k;
+        while (k <= r->k1 && (end < share || i == n - 1))
+            end += fib_range_bound(k++, fmt);
+        seg[i].k1 = k - 1;
+        seg[i].format = fmt;
+        seg[i].out = out + off;
+        seg[i].size = end - off;
+        off = end;
+        if (seg[i].k1 < seg[i].k0)
+            continue;
+        INIT_WORK(&seg[i].work, fib_range_work);
+        queue_work(system_unbound_wq, &seg[i].work);
+    }
+
+    long ret = 0;
+    bool gap = false; /* a segment stopped short, the rest must go */
+    for (unsigned int i = 0; i < n; i++) {
+        if (seg[i].k1 < seg[i].k0)
+            continue;
+        flush_work(&seg[i].work);
+        if (seg[i].err)
+            ret = seg[i].err;
+        if (!ret && !gap) {
+            memmove(out + r->used, seg[i].out, seg[i].used);
+            r->used += seg[i].used;
+            r->count += seg[i].count;
+            gap = seg[i].count < (u64) (seg[i].k1 - seg[i].k0 + 1);
+        }
+    }
+    kvfree(seg);
+    return ret;
+}
+
+/*
+ * Seek to k0 once, then step by additions, packing every record into one
+ * kernel buffer that goes out with a single copy_to_user. Long ranges are
+ * spread over workers when the whole result fits.
+ */
+static long fib_ioctl_range(struct fib_ctx *fc, struct fib_range __user *arg)
+{
+    struct fib_range r;
+    if (copy_from_user(&r, arg, sizeof(r)))
+        return -EFAULT;
+    if (r.k0 < 0 || r.k1 < r.k0 || r.k1 > READ_ONCE(fib_max_length))
+        return -EINVAL;
+    long ret = fib_check_mem(r.k1);
+    if (ret)
+        return ret;
+
+    size_t size = min_t(u64, r.size, FIB_RANGE_MAX_BYTES);
+    char *out = kvmalloc(size, GFP_KERNEL);
+    if (!out)
+        return -ENOMEM;
+
+    unsigned int fmt = READ_ONCE(fc->format);
+    unsigned int jobs = READ_ONCE(fib_range_jobs) ?: num_online_cpus();
+    unsigned int n = min_t(u64, jobs, (r.k1 - r.k0 + 1) / FIB_RANGE_SEG_MIN);
+    r.count = 0;
+    r.used = 0;
+    if (n > 1 && (r.k1 - r.k0 + 1) * fib_range_bound(r.k1, fmt) <= size) {
+        ret = fib_range_parallel(&r, fmt, out, n);
+    } else if (!mutex_lock_interruptible(&fc->lock)) {
+        struct fib_range_seg seg = {
+            .k0 = r.k0,
+            .k1 = r.k1,
+            .format = fmt,
+            .out = out,
+            .size = size,
+        };
+        seg.err = fib_seek(fc, r.k0);
+        if (!seg.err) {
+            fib_range_fill(&seg, fc->seq_a, fc->seq_b, &fc->arena);
+            fc->seq_k = seg.err ? -1 : seg.k;
+        }
+        bn_arena_reset(&fc->arena);
+        mutex_unlock(&fc->lock);
+        ret = seg.err;
+        r.count = seg.count;
+        r.used = seg.used;
+    } else {
+        ret = -ERESTARTSYS;
+    }
+
+    if (!ret && !r.count)
+        ret = -ENOSPC;
+    if (!ret && copy_to_user(u64_to_user_ptr(r.buf), out, r.used))
+        ret = -EFAULT;
+    kvfree(out);
+    if (ret)
+        return ret;
+
+    if (copy_to_user(arg, &r, sizeof(r)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * Hand F(k) over through the mapped area. The result is rendered straight
+ * into it, only the scratch of the decimal conversion is in the arena.
+ */
+static long fib_ioctl_map(struct fib_ctx *fc, struct fib_map __user *arg)
+{
+    struct fib_map m;
+    if (copy_from_user(&m, arg, sizeof(m)))
+        return -EFAULT;
+    if (m.k < 0 || m.k > READ_ONCE(fib_max_length))
+        return -EINVAL;
+
+    unsigned int fmt = READ_ONCE(fc->format);
+    if (mutex_lock_interruptible(&fc->lock))
+        return -ERESTARTSYS;
+
+    long ret = fib_seek(fc, m.k);
+    if (!ret) {
+        size_t need = fib_render_size(fc->seq_a, fmt);
+
+        mutex_lock(&fc->map_lock);
+        if (fc->map && need <= fc->map_size) {
+            m.len = fib_render_into(fc->seq_a, fmt, &fc->arena, fc->map);
+            ret = m.len ? 0 : -ENOMEM;
+        } else {
+            m.len = PAGE_ALIGN(need);
+            ret = -EOVERFLOW;
+        }
+        mutex_unlock(&fc->map_lock);
+    }
+    bn_arena_reset(&fc->arena);
+    mutex_unlock(&fc->lock);
+
+    m.format = fmt;
+    if (copy_to_user(arg, &m, sizeof(m)))
+        return -EFAULT;
+    return ret;
+}
+
+/* Take back the area behind completions user space has released */
+static void fib_ring_reclaim(struct fib_ring *r)
+{
+    u32 head = smp_load_acquire(&r->hdr->cq_head);
+
+    /* a head outside the completions that are out is bogus */
+    if (head - r->cq_head > r->cq_tail - r->cq_head || head == r->cq_head)
+        return;
+    r->area_head = r->area_end[(head - 1) & r->mask];
+    r->cq_head = head;
+}
+
+/*
+ * Find len contiguous bytes of the area for the next result, starting over
+ * at the beginning rather than wrapping it. *start gets their running
+ * offset.
+ */
+static bool fib_ring_area_get(struct fib_ring *r, u64 len, u64 *start)
+{
+    /*
+     * Nothing in use, start at 0 again. Completions still out have no
+     * bytes, their ends all equal area_tail and move along.
+     */
+    if (r->area_head == r->area_tail) {
+        for (u32 i = r->cq_head; i != r->cq_tail; i++)
+            r->area_end[i & r->mask] = 0;
+        r->area_head = r->area_tail = 0;
+    }
+
+    u64 pos = r->area_tail % r->area_size;
+    if (pos + len <= r->area_size) {
+        if (r->area_tail + len - r->area_head > r->area_size)
+            return false;
+        *start = r->area_tail;
+        return true;
+    }
+
+    /*
+     * Wrap: [0, len) of the next lap only has to stay clear of the oldest
+     * result still out, at area_head. The bytes skipped at the end count
+     * as used until then, but nothing else could go there anyway.
+     */
+    u64 lap = r->area_tail - pos + r->area_size;
+    if (lap + len - r->area_head > r->area_size)
+        return false;
+    *start = lap;
+    return true;
+}
+
+/*
+ * Put F(s->k) in the area and fill its completion, fc->lock held. Return
+ * false, leaving the submission queued, while the area has no room for it.
+ */
+static bool fib_ring_serve(struct fib_ctx *fc,
+                           struct fib_ring *r,
+                           const struct fib_submit *s,
+                           struct fib_cqe *c)
+{
+    unsigned int fmt = READ_ONCE(fc->format);
+    struct fib_cache_entry *e = NULL;
+    size_t len;
+    u64 start;
+
+    memset(c, 0, sizeof(*c));
+    c->k = s->k;
+    c->tag = s->tag;
+    c->format = fmt;
+    if (s->k < 0 || s->k > READ_ONCE(fib_max_length)) {
+        c->err = -EINVAL;
+        return true;
+    }
+    c->err = fib_check_mem(s->k);
+    if (c->err)
+        return true;
+
+    /* room for the largest possible result, before any work is done */
+    u64 bound = fib_range_bound(s->k, fmt);
+    if (bound > r->area_size) {
+        c->err = -EOVERFLOW;
+        c->len = bound;
+        return true;
+    }
+    if (!fib_ring_area_get(r, bound, &start))
+        return false;
+
+    char *out = NULL;
+    if (fmt == FIB_FMT_DEC)
+        e = fib_cache_get(s->k);
+    if (e) {
+        out = e->str;
+        len = e->len;
+    } else {
+        c->err = fib_seek(fc, s->k);
+        if (!c->err)
+            out = fib_render(fc->seq_a, fmt, &fc->arena, &len);
+        if (!out && !c->err)
+            c->err = -ENOMEM;
+    }
+
+    if (out) {
+        c->off = start % r->area_size;
+        c->len = len;
+        memcpy(r->area + c->off, out, len);
+        r->area_tail = start + len;
+        if (!e && fmt == FIB_FMT_DEC)
+            fib_cache_insert(s->k, out, len);
+    }
+    if (e)
+        fib_cache_put(e);
+    bn_arena_reset(&fc->arena);
+    return true;
+}
+
+/*
+ * Serve submissions until the SQ is empty or the CQ or the area is full.
+ * Return how many were served.
+ */
+static unsigned int fib_ring_drain(struct fib_ring *r)
+{
+    struct fib_ctx *fc = r->fc;
+    struct fib_ring_hdr *h = r->hdr;
+    unsigned int served = 0;
+
+    /* the poller comes by often, don't take the lock for nothing */
+    r->sq_seen = smp_load_acquire(&h->sq_tail);
+    if (r->sq_seen == r->sq_head)
+        return 0;
+
+    mutex_lock(&fc->lock);
+    for (;;) {
+        u32 tail = smp_load_acquire(&h->sq_tail);
+
+        r->sq_seen = tail;
+        if (tail == r->sq_head || tail - r->sq_head > r->mask + 1)
+            break;
+        fib_ring_reclaim(r);
+        if (r->cq_tail - r->cq_head > r->mask)
+            break;
+
+        /* copy the slot once, user space may be rewriting it */
+        struct fib_submit *slot = &r->sqes[r->sq_head & r->mask];
+        struct fib_submit s = {
+            .k = READ_ONCE(slot->k),
+            .tag = READ_ONCE(slot->tag),
+        };
+        struct fib_cqe c;
+        if (!fib_ring_serve(fc, r, &s, &c))
+            break;
+
+        r->cqes[r->cq_tail & r->mask] = c;
+        r->area_end[r->cq_tail & r->mask] = r->area_tail;
+        smp_store_release(&h->cq_tail, ++r->cq_tail);
+        smp_store_release(&h->sq_head, ++r->sq_head);
+        served++;
+        cond_resched();
+    }
+    mutex_unlock(&fc->lock);
+
+    if (served)
+        wake_up_interruptible_poll(&fc->async_wait, EPOLLIN | EPOLLRDNORM);
+    return served;
+}
+
+static void fib_ring_work(struct work_struct *work)
+{
+    fib_ring_drain(container_of(work, struct fib_ring, work));
+}
+
+/* FIB_RING_SQPOLL thread: poll while submissions come, sleep when idle */
+static int fib_ring_poller(void *data)
+{
+    struct fib_ring *r = data;
+    u64 idle = 0;
+
+    while (!kthread_should_stop()) {
+        if (fib_ring_drain(r) || !idle) {
+            idle = ktime_get_ns() + READ_ONCE(fib_ring_idle_us) * 1000ULL;
+            continue;
+        }
+        if (ktime_get_ns() < idle) {
+            cond_resched();
+            continue;
+        }
+
+        WRITE_ONCE(r->hdr->flags, FIB_RING_NEED_WAKEUP);
+        /* set the flag before the last look, submitters do the reverse */
+        smp_mb();
+        if (smp_load_acquire(&r->hdr->sq_tail) == r->sq_seen)
+            wait_event_interruptible(
+                r->wait, READ_ONCE(r->kick) || kthread_should_stop());
+        WRITE_ONCE(r->kick, false);
+        WRITE_ONCE(r->hdr->flags, 0);
+        idle = 0;
+    }
+    return 0;
+}
+
+static long fib_ioctl_ring_setup(struct fib_ctx *fc,
+                                 struct fib_ring_setup __user *arg)
+{
+    struct fib_ring_setup s;
+    if (copy_from_user(&s, arg, sizeof(s)))
+        return -EFAULT;
+    if (!s.entries || s.entries > FIB_RING_MAX_ENTRIES || !s.area_size ||
+        s.area_size > FIB_RING_MAX_AREA || (s.flags & ~FIB_RING_SQPOLL))
+        return -EINVAL;
+
+    struct fib_ring *r = kzalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    INIT_WORK(&r->work, fib_ring_work);
+    init_waitqueue_head(&r->wait);
+    r->fc = fc;
+
+    s.entries = roundup_pow_of_two(s.entries);
+    s.sq_off = L1_CACHE_ALIGN(sizeof(struct fib_ring_hdr));
+    s.cq_off = s.sq_off + s.entries * sizeof(struct fib_submit);
+    s.area_off = PAGE_ALIGN(s.cq_off + s.entries * sizeof(struct fib_cqe));
+    s.map_size = PAGE_ALIGN(s.area_off + s.area_size);
+
+    long ret = -ENOMEM;
+    r->map = vmalloc_user(s.map_size);
+    r->area_end = kvcalloc(s.entries, sizeof(*r->area_end), GFP_KERNEL);
+    if (!r->map || !r->area_end)
+        goto fail;
+    r->hdr = r->map;
+    r->hdr->entries = s.entries;
+    r->sqes = r->map + s.sq_off;
+    r->cqes = r->map + s.cq_off;
+    r->area = r->map + s.area_off;
+    r->area_size = s.area_size;
+    r->mask = s.entries - 1;
+
+    if (s.flags & FIB_RING_SQPOLL) {
+        struct task_struct *t =
+            kthread_run(fib_ring_poller, r, "fib_ring/%d", current->pid);
+        if (IS_ERR(t)) {
+            ret = PTR_ERR(t);
+            goto fail;
+        }
+        r->poller = t;
+    }
+
+    ret = -EBUSY;
+    if (cmpxchg(&fc->ring, NULL, r))
+        goto fail;
+    if (copy_to_user(arg, &s, sizeof(s)))
+        return -EFAULT;
+    return 0;
+fail:
+    fib_ring_free(r);
+    return ret;
+}
+
+/* The doorbell, serve whatever the SQ holds */
+static long fib_ioctl_ring_enter(struct fib_ctx *fc)
+{
+    struct fib_ring *r = smp_load_acquire(&fc->ring);
+    if (!r)
+        return -EINVAL;
+
+    if (r->poller) {
+        WRITE_ONCE(r->kick, true);
+        wake_up(&r->wait);
+    } else {
+        queue_work(system_unbound_wq, &r->work);
+    }
+    return 0;
+}
+
+static long fib_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fib_ctx *fc = file->private_data;
+    u32 fmt, mode;
+
+    switch (cmd) {
+    case FIB_IOC_RANGE:
+        return fib_ioctl_range(fc, (struct fib_range __user *) arg);
+    case FIB_IOC_SET_FORMAT:
+        if (get_user(fmt, (u32 __user *) arg))
+            return -EFAULT;
+        if (fmt > FIB_FMT_RAW)
+            return -EINVAL;
+        WRITE_ONCE(fc->format, fmt);
+        return 0;
+    case FIB_IOC_SET_READ_MODE:
+        if (get_user(mode, (u32 __user *) arg))
+            return -EFAULT;
+        if (mode > FIB_READ_COMPLETIONS)
+            return -EINVAL;
+        WRITE_ONCE(fc->read_mode, mode);
+        return 0;
+    case FIB_IOC_MAP:
+        return fib_ioctl_map(fc, (struct fib_map __user *) arg);
+    case FIB_IOC_SUBMIT:
+        return fib_ioctl_submit(fc, (struct fib_submit __user *) arg);
+    case FIB_IOC_RING_SETUP:
+        return fib_ioctl_ring_setup(fc, (struct fib_ring_setup __user *) arg);
+    case FIB_IOC_RING_ENTER:
+        return fib_ioctl_ring_enter(fc);
+    case FIB_IOC_MEASURE:
+        return fib_ioctl_measure(fc, (struct fib_measure __user *) arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static void fib_vm_open(struct vm_area_struct *vma)
+{
+    struct fib_ctx *fc = vma->vm_private_data;
+    atomic_inc(&fc->map_users);
+}
+
+static void fib_vm_close(struct vm_area_struct *vma)
+{
+    struct fib_ctx *fc = vma->vm_private_data;
+    atomic_dec(&fc->map_users);
+}
+
+static const struct vm_operations_struct fib_vm_ops = {
+    .open = fib_vm_open,
+    .close = fib_vm_close,
+};
+
+/*
+ * Map the result area of the file. It is allocated by the first mmap and
+ * reused after that, it only grows while nothing maps it.
+ */
+static int fib_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct fib_ctx *fc = file->private_data;
+    size_t size = vma->vm_end - vma->vm_start;
+    int ret = 0;
+
+    if (vma->vm_pgoff == FIB_RING_OFF >> PAGE_SHIFT) {
+        struct fib_ring *r = smp_load_acquire(&fc->ring);
+        return r ? remap_vmalloc_range(vma, r->map, 0) : -EINVAL;
+    }
+    if (vma->vm_pgoff)
+        return -EINVAL;
+
+    mutex_lock(&fc->map_lock);
+    if (size > fc->map_size) {
+        if (atomic_read(&fc->map_users)) {
+            ret = -EBUSY;
+            goto out;
+        }
+        void *map = vmalloc_user(size);
+        if (!map) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        vfree(fc->map);
+        fc->map = map;
+        fc->map_size = size;
+    }
+
+    ret = remap_vmalloc_range(vma, fc->map, 0);
+    if (!ret) {
+        vma->vm_ops = &fib_vm_ops;
+        vma->vm_private_data = fc;
+        atomic_inc(&fc->map_users);
+    }
+out:
+    mutex_unlock(&fc->map_lock);
+    return ret;
 }
 
 static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
@@ -281,12 +1818,12 @@ static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
         new_pos = file->f_pos + offset;
         break;
     case 2: /* SEEK_END: */
-        new_pos = MAX_LENGTH - offset;
+        new_pos = READ_ONCE(fib_max_length) - offset;
         break;
     }
 
-    if (new_pos > MAX_LENGTH)
-        new_pos = MAX_LENGTH;  // max case
+    if (new_pos > READ_ONCE(fib_max_length))
+        new_pos = READ_ONCE(fib_max_length);  // max case
     if (new_pos < 0)
         new_pos = 0;        // min case
     file->f_pos = new_pos;  // This is what we'll use now
@@ -300,12 +1837,35 @@ const struct file_operations fib_fops = {
     .open = fib_open,
     .release = fib_release,
     .llseek = fib_device_lseek,
+    .unlocked_ioctl = fib_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = fib_mmap,
+    .poll = fib_poll,
+};
+
+static const struct attribute_group *fib_dev_groups[] = {
+    &fib_cache_group,
+    &fib_ckpt_group,
+    NULL,
 };
 
 static int __init init_fib_dev(void)
 {
     int rc = 0;
-    mutex_init(&fib_mutex);
+
+    fib_ctx_cache = KMEM_CACHE(fib_ctx, 0);
+    if (!fib_ctx_cache)
+        return -ENOMEM;
+    fib_par_wq = alloc_workqueue("fibdrv_par", WQ_UNBOUND, 0);
+    if (!fib_par_wq) {
+        kmem_cache_destroy(fib_ctx_cache);
+        return -ENOMEM;
+    }
+    bn_par_run = fib_par_run;
+    /* without BMI2 and ADX the portable loops stay */
+    bn_set_asm(fib_asm);
+    fib_ckpt_init(fib_max_length);
+    fib_stat_init();
 
     // Let's register the device
     // This will dynamically allocate the major number
@@ -327,7 +1887,8 @@ static int __init init_fib_dev(void)
         goto failed_class_create;
     }
 
-    if (!device_create(fib_class, NULL, fib_dev, NULL, DEV_FIBONACCI_NAME)) {
+    if (!device_create_with_groups(fib_class, NULL, fib_dev, NULL,
+                                   fib_dev_groups, DEV_FIBONACCI_NAME)) {
         printk(KERN_ALERT "Failed to create device\n");
         rc = -4;
         goto failed_device_create;
@@ -339,15 +1900,23 @@ failed_device_create:
 failed_class_create:
 failed_cdev:
     unregister_chrdev(major, DEV_FIBONACCI_NAME);
+    kmem_cache_destroy(fib_ctx_cache);
+    fib_ckpt_exit();
+    fib_stat_exit();
+    destroy_workqueue(fib_par_wq);
     return rc;
 }
 
 static void __exit exit_fib_dev(void)
 {
-    mutex_destroy(&fib_mutex);
     device_destroy(fib_class, fib_dev);
     class_destroy(fib_class);
     unregister_chrdev(major, DEV_FIBONACCI_NAME);
+    kmem_cache_destroy(fib_ctx_cache);
+    fib_cache_exit();
+    fib_ckpt_exit();
+    fib_stat_exit();
+    destroy_workqueue(fib_par_wq);
 }
 
 module_init(init_fib_dev);
@@ -0,0 +1,186 @@
+#ifndef _FIBDRV_H_
+#define _FIBDRV_H_
+
+/* ioctl interface of /dev/fibonacci, shared with user space */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * FIB_IOC_RANGE fills buf with F(k0), F(k0 + 1), ..., F(k1), each as a
+ * __u32 byte count followed by that many bytes in the format of the open,
+ * no NUL and no padding. Records that do not fit in size bytes are left
+ * out; count and used tell how far it got, so the caller can continue from
+ * k0 + count.
+ */
+struct fib_range {
+    __s64 k0;    /* first offset */
+    __s64 k1;    /* last offset, inclusive */
+    __u64 buf;   /* user pointer */
+    __u64 size;  /* bytes at buf */
+    __u64 count; /* out: records written */
+    __u64 used;  /* out: bytes written */
+};
+
+/*
+ * Output of read() and FIB_IOC_RANGE records, set per open with
+ * FIB_IOC_SET_FORMAT. FIB_FMT_DEC and FIB_FMT_HEX give digits, read() adds
+ * a NUL. FIB_FMT_RAW gives a struct fib_raw followed by the limbs of |F(k)|,
+ * least significant first, each limb_bytes little-endian bytes.
+ */
+enum fib_format {
+    FIB_FMT_DEC = 0,
+    FIB_FMT_HEX = 1,
+    FIB_FMT_RAW = 2,
+};
+
+struct fib_raw {
+    __u8 sign;
+    __u8 limb_bytes;
+    __u16 reserved;
+    __u32 limbs;
+};
+
+/*
+ * FIB_IOC_MAP renders F(k) in the format of the open straight into the
+ * start of the area mapped with mmap() at offset 0, which later calls
+ * reuse, so the result is never copied. len gets the bytes of the result,
+ * the digit formats add a NUL after them. The area has to hold the largest
+ * result of that many limbs, a decimal one is sized a little above its
+ * digits. When it does not, the call fails with EOVERFLOW and len gets the
+ * size to map instead.
+ */
+struct fib_map {
+    __s64 k;
+    __u32 format; /* out: enum fib_format of the result */
+    __u32 reserved;
+    __u64 len; /* out */
+};
+
+/*
+ * FIB_IOC_SUBMIT queues F(k) for computation in the background and returns
+ * at once, EAGAIN when too many requests of the file are outstanding.
+ * After FIB_IOC_SET_READ_MODE to FIB_READ_COMPLETIONS, read() returns
+ * completions instead of the offset's result: whole records, each a struct
+ * fib_completion followed by len bytes of the result in the format at
+ * submit time, no NUL. When the first record does not fit only its header
+ * is returned, so the buffer can be grown. Without a completion ready a
+ * read waits while requests are outstanding, or fails with EAGAIN if the
+ * file is O_NONBLOCK, and returns 0 when none are. poll() reports POLLIN
+ * while a completion is ready and POLLOUT while a submit would be taken.
+ */
+enum fib_read_mode {
+    FIB_READ_OFFSET = 0,      /* F(offset), the default */
+    FIB_READ_COMPLETIONS = 1, /* FIB_IOC_SUBMIT completions */
+};
+
+struct fib_submit {
+    __s64 k;
+    __u64 tag; /* handed back in the completion */
+};
+
+struct fib_completion {
+    __s64 k;
+    __u64 tag;
+    __s32 err; /* 0 or a negative errno, which leaves len 0 */
+    __u32 format;
+    __u64 len;
+};
+
+/*
+ * FIB_IOC_RING_SETUP creates a submission queue (SQ) and a completion queue
+ * (CQ) of entries slots each, plus a result area, all in one region that is
+ * mapped with mmap() at FIB_RING_OFF. User space fills struct fib_submit
+ * slots of the SQ and advances sq_tail, the driver takes them from sq_head,
+ * writes each result into the area and posts a struct fib_cqe at cq_tail.
+ * Advancing cq_head hands the completions and their results back. Indices
+ * run freely and are masked with entries - 1, the side that advances an
+ * index stores it with release and the other side loads it with acquire.
+ *
+ * FIB_IOC_RING_ENTER is the doorbell that has the driver serve the SQ.
+ * With FIB_RING_SQPOLL a kernel thread polls the SQ instead, going to sleep
+ * after ring_idle_us without submissions. It then sets
+ * FIB_RING_NEED_WAKEUP, and the next submitter has to ring the doorbell.
+ * Submissions wait in the SQ while the CQ or the area is full, ring the
+ * doorbell after freeing room. poll() reports POLLIN while the CQ has
+ * completions.
+ */
+#define FIB_RING_SQPOLL (1U << 0)
+#define FIB_RING_NEED_WAKEUP (1U << 0)
+#define FIB_RING_OFF 0x10000000ULL
+
+struct fib_ring_setup {
+    __u32 entries;   /* slots per queue, rounded up to a power of two */
+    __u32 flags;     /* FIB_RING_SQPOLL */
+    __u64 area_size; /* bytes for results */
+    __u64 map_size;  /* out: bytes to map at FIB_RING_OFF */
+    __u64 sq_off;    /* out: offset of the struct fib_submit array */
+    __u64 cq_off;    /* out: offset of the struct fib_cqe array */
+    __u64 area_off;  /* out: offset of the result area */
+};
+
+/* At offset 0 of the ring mapping */
+struct fib_ring_hdr {
+    __u32 sq_head; /* written by the driver */
+    __u32 sq_tail;
+    __u32 cq_head;
+    __u32 cq_tail; /* written by the driver */
+    __u32 entries;
+    __u32 flags; /* FIB_RING_NEED_WAKEUP, written by the driver */
+};
+
+struct fib_cqe {
+    __s64 k;
+    __u64 tag;
+    __s32 err; /* 0 or a negative errno */
+    __u32 format;
+    __u64 off; /* the result is at area_off + off, no NUL */
+    __u64 len; /* for EOVERFLOW the area size the result needs */
+};
+
+/*
+ * FIB_IOC_MEASURE runs one algorithm for k on the CPU its counters were
+ * opened on and reports the deltas of each counter around the call. The
+ * long long variants are only defined up to F(92). FIB_ALGO_BN_TO_STRING
+ * times the decimal conversion alone, of an F(k) computed beforehand.
+ * Counts cover that CPU only, products that fast doubling hands to other
+ * workers are not in them. FIB_ALGO_BN_FIB is quadratic in k and runs with
+ * the file locked, so it fails with ERANGE past FIB_MEASURE_BN_FIB_MAX,
+ * about 0.1 s of additions. EBUSY means a counter could not be put on the
+ * CPU, e.g. next to an exclusive one of another user, rather than zeros.
+ */
+#define FIB_MEASURE_BN_FIB_MAX 100000
+
+enum fib_algo {
+    FIB_ALGO_SEQUENCE = 0,
+    FIB_ALGO_SEQUENCE2 = 1,
+    FIB_ALGO_FDOUBLING = 2,
+    FIB_ALGO_FDOUBLING_CLZ = 3,
+    FIB_ALGO_BN_FIB = 4,
+    FIB_ALGO_BN_FDOUBLING = 5,
+    FIB_ALGO_BN_TO_STRING = 6,
+};
+
+struct fib_measure {
+    __s64 k;
+    __u32 algo; /* enum fib_algo */
+    __u32 reserved;
+    __u64 ns; /* out: wall time of the call */
+    __u64 cycles;
+    __u64 instructions;
+    __u64 cache_misses;
+    __u64 branch_misses;
+    __s64 result; /* out: F(k) of the long long variants */
+};
+
+#define FIB_IOC_MAGIC 'f'
+#define FIB_IOC_RANGE _IOWR(FIB_IOC_MAGIC, 1, struct fib_range)
+#define FIB_IOC_SET_FORMAT _IOW(FIB_IOC_MAGIC, 2, __u32)
+#define FIB_IOC_MAP _IOWR(FIB_IOC_MAGIC, 3, struct fib_map)
+#define FIB_IOC_SUBMIT _IOW(FIB_IOC_MAGIC, 4, struct fib_submit)
+#define FIB_IOC_RING_SETUP _IOWR(FIB_IOC_MAGIC, 5, struct fib_ring_setup)
+#define FIB_IOC_RING_ENTER _IO(FIB_IOC_MAGIC, 6)
+#define FIB_IOC_MEASURE _IOWR(FIB_IOC_MAGIC, 7, struct fib_measure)
+#define FIB_IOC_SET_READ_MODE _IOW(FIB_IOC_MAGIC, 8, __u32)
+
+#endif
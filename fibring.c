@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "fibring.h"
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int fibring_init(struct fibring *r,
+                 int fd,
+                 unsigned int entries,
+                 size_t area_size,
+                 unsigned int flags)
+{
+    struct fib_ring_setup s = {
+        .entries = entries,
+        .flags = flags,
+        .area_size = area_size,
+    };
+
+    if (ioctl(fd, FIB_IOC_RING_SETUP, &s) < 0)
+        return -errno;
+
+    void *map = mmap(NULL, s.map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, FIB_RING_OFF);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->flags = flags;
+    r->map = map;
+    r->map_size = s.map_size;
+    r->hdr = map;
+    r->sqes = (struct fib_submit *) ((char *) map + s.sq_off);
+    r->cqes = (struct fib_cqe *) ((char *) map + s.cq_off);
+    r->area = (char *) map + s.area_off;
+    r->mask = s.entries - 1;
+    return 0;
+}
+
+void fibring_exit(struct fibring *r)
+{
+    munmap(r->map, r->map_size);
+}
+
+int fibring_submit(struct fibring *r, long long k, unsigned long long tag)
+{
+    unsigned int tail = r->hdr->sq_tail;
+
+    if (tail - load_acquire(&r->hdr->sq_head) > r->mask)
+        return -EAGAIN;
+    r->sqes[tail & r->mask].k = k;
+    r->sqes[tail & r->mask].tag = tag;
+    store_release(&r->hdr->sq_tail, tail + 1);
+    return 0;
+}
+
+int fibring_enter(struct fibring *r)
+{
+    if (r->flags & FIB_RING_SQPOLL) {
+        /* sq_tail before the flag, the polling thread does the reverse */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(load_acquire(&r->hdr->flags) & FIB_RING_NEED_WAKEUP))
+            return 0;
+    }
+    return ioctl(r->fd, FIB_IOC_RING_ENTER) < 0 ? -errno : 0;
+}
+
+struct fib_cqe *fibring_peek(struct fibring *r)
+{
+    unsigned int head = r->hdr->cq_head;
+
+    if (head == load_acquire(&r->hdr->cq_tail))
+        return NULL;
+    return &r->cqes[head & r->mask];
+}
+
+struct fib_cqe *fibring_wait(struct fibring *r)
+{
+    struct fib_cqe *c;
+
+    while (!(c = fibring_peek(r))) {
+        struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+
+        /* the driver may be stalled on a full CQ or area */
+        if (fibring_enter(r) < 0)
+            return NULL;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return NULL;
+    }
+    return c;
+}
+
+void fibring_seen(struct fibring *r)
+{
+    store_release(&r->hdr->cq_head, r->hdr->cq_head + 1);
+}
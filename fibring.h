@@ -0,0 +1,56 @@
+#ifndef _FIBRING_H_
+#define _FIBRING_H_
+
+/* User space side of the FIB_IOC_RING_SETUP rings of /dev/fibonacci */
+
+#include <stddef.h>
+#include "fibdrv.h"
+
+struct fibring {
+    int fd;
+    unsigned int flags;
+    void *map;
+    size_t map_size;
+    struct fib_ring_hdr *hdr;
+    struct fib_submit *sqes;
+    struct fib_cqe *cqes;
+    char *area;
+    unsigned int mask;
+};
+
+/*
+ * Set up and map the rings of fd, entries slots each and area_size bytes
+ * for results. Return 0 or -errno.
+ */
+int fibring_init(struct fibring *r,
+                 int fd,
+                 unsigned int entries,
+                 size_t area_size,
+                 unsigned int flags);
+void fibring_exit(struct fibring *r);
+
+/* Queue F(k), return -EAGAIN while the SQ is full */
+int fibring_submit(struct fibring *r, long long k, unsigned long long tag);
+
+/*
+ * Have the driver serve the SQ, a system call only when no polling thread
+ * is awake to see it. Also needed after freeing completions of a full CQ.
+ */
+int fibring_enter(struct fibring *r);
+
+/* The oldest completion, or NULL when there is none */
+struct fib_cqe *fibring_peek(struct fibring *r);
+
+/* Like fibring_peek(), but wait for one, return NULL on error */
+struct fib_cqe *fibring_wait(struct fibring *r);
+
+static inline const char *fibring_result(const struct fibring *r,
+                                         const struct fib_cqe *c)
+{
+    return r->area + c->off;
+}
+
+/* Release the oldest completion and its result */
+void fibring_seen(struct fibring *r);
+
+#endif
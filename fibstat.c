@@ -0,0 +1,112 @@
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/minmax.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include "bignum.h"
+#include "fibstat.h"
+
+#define CREATE_TRACE_POINTS
+#include "fibtrace.h"
+
+/*
+ * Latency histograms per phase and per offset class. Bucket b counts
+ * requests that took less than 2^b ns, the last one everything slower.
+ * Class c holds offsets below 16^(c + 1), the last one the rest. Every CPU
+ * has its own copy, so recording is a couple of this_cpu ops and readers
+ * add up the copies.
+ */
+#define FIB_STAT_BUCKETS 40
+#define FIB_STAT_CLASSES 7
+
+static const char *const fib_phase_names[FIB_PHASES] = {
+    [FIB_PHASE_COMPUTE] = "compute",
+    [FIB_PHASE_RENDER] = "render",
+    [FIB_PHASE_COPY] = "copy",
+};
+
+struct fib_stat_hist {
+    u64 count[FIB_STAT_BUCKETS];
+    u64 sum_ns;
+};
+
+struct fib_stat_cpu {
+    struct fib_stat_hist hist[FIB_PHASES][FIB_STAT_CLASSES];
+};
+
+static DEFINE_PER_CPU(struct fib_stat_cpu, fib_stat);
+
+static struct dentry *fib_stat_dir;
+
+void fib_stat_add(enum fib_phase ph, long long k, u64 ns)
+{
+    unsigned int c = min_t(int, max(fls64(k) - 1, 0) / 4, FIB_STAT_CLASSES - 1);
+    unsigned int b = min_t(int, fls64(ns), FIB_STAT_BUCKETS - 1);
+
+    this_cpu_inc(fib_stat.hist[ph][c].count[b]);
+    this_cpu_add(fib_stat.hist[ph][c].sum_ns, ns);
+}
+
+/*
+ * One line per phase and offset class that saw requests: the count, the
+ * total ns, then "b:n" for every bucket with n requests under 2^b ns
+ */
+static int latency_show(struct seq_file *m, void *v)
+{
+    struct fib_stat_hist h;
+
+    for (int ph = 0; ph < FIB_PHASES; ph++) {
+        for (int c = 0; c < FIB_STAT_CLASSES; c++) {
+            u64 total = 0;
+            int cpu;
+
+            memset(&h, 0, sizeof(h));
+            for_each_possible_cpu (cpu) {
+                struct fib_stat_hist *p =
+                    per_cpu_ptr(&fib_stat.hist[ph][c], cpu);
+
+                for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+                    h.count[b] += READ_ONCE(p->count[b]);
+                h.sum_ns += READ_ONCE(p->sum_ns);
+            }
+            for (int b = 0; b < FIB_STAT_BUCKETS; b++)
+                total += h.count[b];
+            if (!total)
+                continue;
+
+            if (c < FIB_STAT_CLASSES - 1)
+                seq_printf(m, "%s k<2^%d", fib_phase_names[ph], 4 * (c + 1));
+            else
+                seq_printf(m, "%s k>=2^%d", fib_phase_names[ph], 4 * c);
+            seq_printf(m, " count=%llu sum_ns=%llu", total, h.sum_ns);
+            for (int b = 0; b < FIB_STAT_BUCKETS; b++) {
+                if (h.count[b])
+                    seq_printf(m, " %d:%llu", b, h.count[b]);
+            }
+            seq_putc(m, '\n');
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int allocs_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "count=%ld bytes=%ld\n", bn_alloc_count(), bn_alloc_bytes());
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(allocs);
+
+void fib_stat_init(void)
+{
+    /* debugfs is optional, failures only leave the files out */
+    fib_stat_dir = debugfs_create_dir("fibonacci", NULL);
+    debugfs_create_file("latency", 0444, fib_stat_dir, NULL, &latency_fops);
+    debugfs_create_file("allocs", 0444, fib_stat_dir, NULL, &allocs_fops);
+}
+
+void fib_stat_exit(void)
+{
+    debugfs_remove_recursive(fib_stat_dir);
+}
@@ -0,0 +1,21 @@
+#ifndef _FIBSTAT_H_
+#define _FIBSTAT_H_
+
+#include <linux/types.h>
+
+/* Phases of a request, timed separately */
+enum fib_phase {
+    FIB_PHASE_COMPUTE, /* F(k) as a bignum */
+    FIB_PHASE_RENDER,  /* conversion to the output format */
+    FIB_PHASE_COPY,    /* copy_to_user */
+    FIB_PHASES,
+};
+
+/* Create and remove the debugfs directory */
+void fib_stat_init(void);
+void fib_stat_exit(void);
+
+/* Count ns spent in phase ph of a request for offset k, lockless */
+void fib_stat_add(enum fib_phase ph, long long k, u64 ns);
+
+#endif
@@ -0,0 +1,65 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fibdrv
+
+#if !defined(_FIBTRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _FIBTRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* clang-format off */
+TRACE_EVENT(fib_request_start,
+
+    TP_PROTO(long long k, unsigned int format),
+
+    TP_ARGS(k, format),
+
+    TP_STRUCT__entry(
+        __field(long long, k)
+        __field(unsigned int, format)
+    ),
+
+    TP_fast_assign(
+        __entry->k = k;
+        __entry->format = format;
+    ),
+
+    TP_printk("k=%lld format=%u", __entry->k, __entry->format)
+);
+
+TRACE_EVENT(fib_request_end,
+
+    TP_PROTO(long long k, long ret, u64 compute_ns, u64 render_ns,
+             u64 copy_ns),
+
+    TP_ARGS(k, ret, compute_ns, render_ns, copy_ns),
+
+    TP_STRUCT__entry(
+        __field(long long, k)
+        __field(long, ret)
+        __field(u64, compute_ns)
+        __field(u64, render_ns)
+        __field(u64, copy_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->k = k;
+        __entry->ret = ret;
+        __entry->compute_ns = compute_ns;
+        __entry->render_ns = render_ns;
+        __entry->copy_ns = copy_ns;
+    ),
+
+    TP_printk("k=%lld ret=%ld compute_ns=%llu render_ns=%llu copy_ns=%llu",
+              __entry->k, __entry->ret, __entry->compute_ns,
+              __entry->render_ns, __entry->copy_ns)
+);
+/* clang-format on */
+
+#endif
+
+/* trace/define_trace.h reads this file again, from the module directory */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fibtrace
+#include <trace/define_trace.h>
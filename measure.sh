@@ -15,7 +15,8 @@ sudo bash -c "echo 1 > /sys/devices/system/cpu/cpu$CPUID/cpuidle/state1/disable"
 make client_stat
 make load
 rm -f plot_input
-sudo taskset -c $CPUID ./client_stat >plot_input
+# arguments go to client_stat, e.g. -a bn_fdoubling -s 0 -e 100000 -i 1000
+sudo taskset -c $CPUID ./client_stat "$@" >plot_input
 gnuplot scripts/plot.gp
 make unload
 
@@ -1,12 +1,22 @@
 reset
+set datafile separator ','
 set xlabel 'F(n)'
 set ylabel 'cycle'
-set title 'Fibonacci runtime'
+set title 'Fibonacci runtime (median)'
 set term png
 set output 'plot.png'
 set grid
-plot [0:92][0:1000]'plot_input'\
-using 1:2 with linespoints linewidth 2 title 'naive dynamic',\
-'' using 1:3 with linespoints linewidth 2 title 'naive static',\
-'' using 1:4 with linespoints linewidth 2 title 'fast doubling',\
-'' using 1:5 with linespoints linewidth 2 title 'fast doubling w/ clz'
+set key left top
+# one line per algorithm of the client_stat CSV, axes follow the data
+algos = system("tail -n +2 plot_input | cut -d, -f1 | uniq")
+plot for [a in algos] 'plot_input' \
+    using 2:(strcol(1) eq a ? $14 : 1/0) with linespoints linewidth 2 title a
+
+# what user space waits for against what the driver spends computing
+set ylabel 'ns'
+set title 'User space vs. kernel time (median)'
+set output 'plot_overhead.png'
+plot for [a in algos] 'plot_input' \
+    using 2:(strcol(1) eq a ? $4 : 1/0) with linespoints title a.' user', \
+     for [a in algos] 'plot_input' \
+    using 2:(strcol(1) eq a ? $9 : 1/0) with lines dashtype 2 title a.' kernel'
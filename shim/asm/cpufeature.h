@@ -0,0 +1,8 @@
+#ifndef _SHIM_ASM_CPUFEATURE_H_
+#define _SHIM_ASM_CPUFEATURE_H_
+
+#define X86_FEATURE_ADX "adx"
+#define X86_FEATURE_BMI2 "bmi2"
+#define boot_cpu_has(feature) __builtin_cpu_supports(feature)
+
+#endif
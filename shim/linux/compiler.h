@@ -0,0 +1,7 @@
+#ifndef _SHIM_LINUX_COMPILER_H_
+#define _SHIM_LINUX_COMPILER_H_
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *) &(x) = (v))
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef _SHIM_LINUX_ERRNO_H_
+#define _SHIM_LINUX_ERRNO_H_
+
+/* The uapi header has the E* values, <errno.h> itself comes back here */
+#include_next <linux/errno.h>
+
+#endif
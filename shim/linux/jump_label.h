@@ -0,0 +1,16 @@
+#ifndef _SHIM_LINUX_JUMP_LABEL_H_
+#define _SHIM_LINUX_JUMP_LABEL_H_
+
+#include <linux/types.h>
+
+/* A plain flag instead of a patched branch */
+struct static_key_false {
+    bool enabled;
+};
+
+#define DEFINE_STATIC_KEY_FALSE(name) struct static_key_false name = {false}
+#define static_branch_likely(key) __builtin_expect((key)->enabled, 1)
+#define static_branch_enable(key) ((key)->enabled = true)
+#define static_branch_disable(key) ((key)->enabled = false)
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _SHIM_LINUX_KERNEL_H_
+#define _SHIM_LINUX_KERNEL_H_
+
+#include <string.h>
+#include "minmax.h"
+#include "types.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#endif
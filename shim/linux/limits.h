@@ -0,0 +1,9 @@
+#ifndef _SHIM_LINUX_LIMITS_H_
+#define _SHIM_LINUX_LIMITS_H_
+
+/* <limits.h> includes the uapi header too, which has to come first */
+#include_next <linux/limits.h>
+#include <limits.h>
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _SHIM_LINUX_LINKAGE_H_
+#define _SHIM_LINUX_LINKAGE_H_
+
+#ifdef __ASSEMBLER__
+/* clang-format off */
+#define SYM_FUNC_START(name) .globl name; .type name, @function; .p2align 4; name:
+#define SYM_FUNC_END(name) .size name, . - name
+#define RET ret
+
+	.section .note.GNU-stack, "", @progbits
+/* clang-format on */
+#else
+#define asmlinkage
+#endif
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _SHIM_LINUX_MM_H_
+#define _SHIM_LINUX_MM_H_
+
+#include "slab.h"
+
+static inline void *kvmalloc(size_t size, int flags)
+{
+    return kmalloc(size, flags);
+}
+
+static inline void kvfree(const void *p)
+{
+    kfree(p);
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef _SHIM_LINUX_PERCPU_H_
+#define _SHIM_LINUX_PERCPU_H_
+
+/* One "CPU", updated atomically so threaded callers stay exact */
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name
+#define this_cpu_inc(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define this_cpu_add(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define per_cpu(x, cpu) ((void) (cpu), __atomic_load_n(&(x), __ATOMIC_RELAXED))
+
+#endif
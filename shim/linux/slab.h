@@ -0,0 +1,31 @@
+#ifndef _SHIM_LINUX_SLAB_H_
+#define _SHIM_LINUX_SLAB_H_
+
+#include <stdlib.h>
+
+#define GFP_KERNEL 0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+    (void) flags;
+    return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+    (void) flags;
+    return calloc(1, size);
+}
+
+static inline void *krealloc(const void *p, size_t size, int flags)
+{
+    (void) flags;
+    return realloc((void *) p, size);
+}
+
+static inline void kfree(const void *p)
+{
+    free((void *) p);
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _SHIM_LINUX_TYPES_H_
+#define _SHIM_LINUX_TYPES_H_
+
+/* User space stand-ins for what bignum.c takes from the kernel */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#endif